@@ -2,6 +2,7 @@
 #include <ostream>
 #include <cmath>
 #include <iostream>
+#include "stats.h"
 
 class Canvas
 {
@@ -56,6 +57,7 @@ public:
     {
         //std::cout << "Drawing line from (" << x1 << ',' << y1 << ") to ("
             //<< x2 << ',' << y2 << ")\n";
+        double start = stats ? statsClock() : 0;
 
         if (x1 > x2)
         {
@@ -131,10 +133,15 @@ public:
         //                   stepping in -y direction and y >= yend
         // if +xstep, inc x
         // if -xstep, add ystep to y
+        // Pixels on the canvas, for the stats
+        unsigned long long fragments = 0;
+
         int x, y;
         for (x = x1p, y = y1p; xdir ? (x <= x2p) : (ystep > 0 ? y <= y2p : y >= y2p); xdir ? x++ : y += ystep)
         {
             //std::cout << "Trying (" << x << ',' << y << ") && F = " << F << " && ";
+            if (x >= 0 && x < (int)xres_ && y >= 0 && y < (int)yres_)
+                fragments++;
             drawPixel(x, y, 1.0, 1.0, 1.0);
             if (F < 0)
             {
@@ -150,6 +157,23 @@ public:
 
         //std::cout << " ---- Done Drawing Line ---- \n";
 
+        if (stats)
+        {
+            stats->lines++;
+            stats->fragments += fragments;
+            stats->shaded += fragments;
+            stats->raster += statsClock() - start;
+        }
+    }
+
+    // Returns how many pixels aren't black any more
+    unsigned long long coveredPixels() const
+    {
+        unsigned long long count = 0;
+        for (unsigned i = 0; i < xres_ * yres_; i++)
+            if (r_[i] != 0 || g_[i] != 0 || b_[i] != 0)
+                count++;
+        return count;
     }
 
     void display(std::ostream &os, unsigned maxintensity)
@@ -2,14 +2,18 @@
 #include <fstream>
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
+#include "stats.h"
+
+renderStats *stats = NULL;
 
 void parse_file(std::istream &input, Canvas *output);
 
 int main(int argc, char **argv)
 {
-    if (argc != 7)
+    if (argc != 7 && !(argc == 9 && (strcmp(argv[7], "-stats") == 0 || strcmp(argv[7], "--stats") == 0)))
     {
-        std::cerr << "usage: draw2d xmin xmax ymin ymax xRes yRes\n";
+        std::cerr << "usage: draw2d xmin xmax ymin ymax xRes yRes [-stats file.json]\n";
         exit(1);
     }
     float xmin, xmax, ymin, ymax;
@@ -21,13 +25,33 @@ int main(int argc, char **argv)
     xRes = atoi(argv[5]);
     yRes = atoi(argv[6]);
 
+    renderStats collected;
+    if (argc == 9)
+        stats = &collected;
+
     Canvas pic(xmin, xmax, ymin, ymax, xRes, yRes);
+    // Lines are drawn as they're parsed, don't count that time twice
+    double start = statsClock();
     parse_file(std::cin, &pic);
+    collected.parse = statsClock() - start - collected.raster;
 
     //std::fstream file("draw2doutput.ppm", std::fstream::out);
+    start = statsClock();
     pic.display(std::cout, 255);
+    std::cout.flush();
+    collected.output = statsClock() - start;
     //file.close();
 
+    if (stats)
+    {
+        collected.pixels = pic.coveredPixels();
+        collected.print(std::cerr);
+        std::ofstream json(argv[8]);
+        collected.printJSON(json);
+        if (!json)
+            std::cerr << "Couldn't write stats to " << argv[8] << '\n';
+    }
+
     return 0;
 }
 
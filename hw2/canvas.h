@@ -1,7 +1,13 @@
 #pragma once
 #include <ostream>
+#include <algorithm>
 #include <cmath>
+#include <cstdlib>
 #include <iostream>
+#include "stats.h"
+
+// Width and height in pixels of the square tiles the canvas is split into
+static const unsigned TILE_SIZE = 8;
 
 class Canvas
 {
@@ -10,7 +16,12 @@ public:
     Canvas() :
         r_(NULL),
         g_(NULL),
-        b_(NULL)
+        b_(NULL),
+        z_(NULL),
+        tileCleared_(NULL),
+        tileZMin_(NULL),
+        tileZMax_(NULL),
+        tileZMaxCount_(NULL)
     {}
 
     Canvas(float xmin, float xmax, float ymin, float ymax, unsigned xres, unsigned yres) :
@@ -19,17 +30,21 @@ public:
         ymin_(ymin),
         ymax_(ymax),
         xres_(xres),
-        yres_(yres)
+        yres_(yres),
+        xtiles_((xres + TILE_SIZE - 1) / TILE_SIZE),
+        ytiles_((yres + TILE_SIZE - 1) / TILE_SIZE)
     {
         r_ = new float[xres * yres];
         b_ = new float[xres * yres];
         g_ = new float[xres * yres];
+        z_ = new float[xres * yres];
+        tileCleared_ = new bool[xtiles_ * ytiles_];
+        tileZMin_ = new float[xtiles_ * ytiles_];
+        tileZMax_ = new float[xtiles_ * ytiles_];
+        tileZMaxCount_ = new unsigned[xtiles_ * ytiles_];
 
-        // Initialize to black
-        for (unsigned i = 0; i < xres * yres; i++)
-        {
-            r_[i] = b_[i] = g_[i] = 0.0f;
-        }
+        // Initialize to black, and infinite z
+        clear();
     }
 
     ~Canvas()
@@ -37,6 +52,50 @@ public:
         delete[] r_;
         delete[] g_;
         delete[] b_;
+        delete[] z_;
+        delete[] tileCleared_;
+        delete[] tileZMin_;
+        delete[] tileZMax_;
+        delete[] tileZMaxCount_;
+    }
+
+    // Clears the canvas to black and infinite z.  Pixels are not
+    // touched here, only the tiles are marked; a tile is actually filled in
+    // the first time it is drawn to.
+    void clear()
+    {
+        for (unsigned i = 0; i < xtiles_ * ytiles_; i++)
+        {
+            tileCleared_[i] = true;
+            tileZMin_[i] = tileZMax_[i] = HUGE_VAL;
+        }
+    }
+
+    int getPixelX(float n) const
+    {
+        return floor((n - xmin_) / (xmax_ - xmin_) * xres_);
+    }
+
+    int getPixelY(float n) const
+    {
+        return floor((ymax_ - n) / (ymax_ - ymin_) * yres_);
+    }
+
+    int getXRes() const
+    {
+        return xres_;
+    }
+
+    int getYRes() const
+    {
+        return yres_;
+    }
+
+    // Returns true if every pixel of tile (tx, ty) is nearer than zmin, that
+    // is, nothing with depth zmin or farther can be drawn in that tile.
+    bool tileOccludes(unsigned tx, unsigned ty, float zmin) const
+    {
+        return zmin > tileZMax_[ty * xtiles_ + tx];
     }
 
     void drawPixel(unsigned x, unsigned y, float r, float g, float b)
@@ -44,15 +103,57 @@ public:
         if (x < 0 || x >= xres_ || y < 0 || y >= yres_)
             return;
 
+        // Clamp the colors
+        colorClamp(r,g,b);
+
         //std::cout << "Drawing pixel: (" << x << ',' << y << ")\n";
 
+        touchTile(x, y);
+
         int i = y * xres_ + x;
         r_[i] = r;
         g_[i] = g;
         b_[i] = b;
     }
 
+    // Writes only the z buffer, respecting the depth test
+    void drawDepth(unsigned x, unsigned y, float z)
+    {
+        if (x < 0 || x >= xres_ || y < 0 || y >= yres_ || z < -1)
+            return;
+
+        int i = y * xres_ + x;
+        // A cleared tile is infinitely far away so there's no need to read
+        // the z buffer
+        float old = HUGE_VAL;
+        if (!touchTile(x, y) && z > (old = z_[i]))
+            return;
+
+        z_[i] = z;
+        updateTileDepth(x, y, old, z);
+    }
+
+    // Returns true if a fragment at depth z would pass the depth test at
+    // pixel (x, y).  Doesn't touch the canvas.
+    bool depthPasses(unsigned x, unsigned y, float z) const
+    {
+        if (x < 0 || x >= xres_ || y < 0 || y >= yres_ || z < -1)
+            return false;
+        if (tileCleared_[(y / TILE_SIZE) * xtiles_ + x / TILE_SIZE])
+            return true;
+        return z <= z_[y * xres_ + x];
+    }
+
     void drawLine(float x1, float y1, float x2, float y2)
+    {
+        drawLine(x1, y1, 0, x2, y2, 0, HUGE_VAL);
+    }
+
+    // Draws a line whose pixels are depth tested against, but don't write,
+    // the z buffer.  Pixels up to bias behind the stored depth still pass, so
+    // edges of the faces that filled the z buffer stay visible.  A bias of
+    // HUGE_VAL turns off the depth test.
+    void drawLine(float x1, float y1, float z1, float x2, float y2, float z2, float bias)
     {
         //std::cout << "Drawing line from (" << x1 << ',' << y1 << ") to ("
             //<< x2 << ',' << y2 << ")\n";
@@ -61,15 +162,19 @@ public:
         {
             std::swap(x1, x2);
             std::swap(y1, y2);
+            std::swap(z1, z2);
         }
         else if (x1 == x2 && y2 > y1)
+        {
             std::swap(y1, y2);
+            std::swap(z1, z2);
+        }
 
         // Convert to pixel coords
-        int x1p = floor((x1 - xmin_) / (xmax_ - xmin_) * xres_);
-        int y1p = floor((ymax_ - y1) / (ymax_ - ymin_) * yres_);
-        int x2p = floor((x2 - xmin_) / (xmax_ - xmin_) * xres_);
-        int y2p = floor((ymax_ - y2) / (ymax_ - ymin_) * yres_);
+        int x1p = getPixelX(x1);
+        int y1p = getPixelY(y1);
+        int x2p = getPixelX(x2);
+        int y2p = getPixelY(y2);
         
         // Direction control
         bool xdir = true;
@@ -131,11 +236,28 @@ public:
         //                   stepping in -y direction and y >= yend
         // if +xstep, inc x
         // if -xstep, add ystep to y
+        // z changes linearly with each step along the major axis
+        int steps = xdir ? x2p - x1p : abs(y2p - y1p);
+        float z = z1;
+        float dz = steps ? (z2 - z1) / steps : 0;
+
+        // Pixels on the canvas, and those hidden, for the stats
+        unsigned long long fragments = 0, rejected = 0;
+
         int x, y;
-        for (x = x1p, y = y1p; xdir ? (x <= x2p) : (ystep > 0 ? y <= y2p : y >= y2p); xdir ? x++ : y += ystep)
+        for (x = x1p, y = y1p; xdir ? (x <= x2p) : (ystep > 0 ? y <= y2p : y >= y2p); xdir ? x++ : y += ystep, z += dz)
         {
             //std::cout << "Trying (" << x << ',' << y << ") && F = " << F << " && ";
-            drawPixel(x, y, 1.0, 1.0, 1.0);
+            if (x >= 0 && x < (int)xres_ && y >= 0 && y < (int)yres_)
+            {
+                fragments++;
+                // Nothing stored is nearer than -1, so biasing past it
+                // passes regardless
+                if (bias == HUGE_VAL || depthPasses(x, y, std::max(z - bias, -1.0f)))
+                    drawPixel(x, y, 1.0, 1.0, 1.0);
+                else
+                    rejected++;
+            }
             if (F < 0)
             {
                 F += dv;
@@ -150,32 +272,150 @@ public:
 
         //std::cout << " ---- Done Drawing Line ---- \n";
 
+        if (stats)
+        {
+            stats->fragments += fragments;
+            stats->depthRejected += rejected;
+            stats->shaded += fragments - rejected;
+        }
+    }
+
+    // Returns how many pixels have been drawn to since the last clear, that
+    // is, are no longer black
+    unsigned long long coveredPixels() const
+    {
+        unsigned long long count = 0;
+        for (unsigned y = 0; y < yres_; y++)
+        {
+            for (unsigned x = 0; x < xres_; x++)
+            {
+                unsigned i = y * xres_ + x;
+                if (!tileCleared_[(y / TILE_SIZE) * xtiles_ + x / TILE_SIZE] &&
+                        (r_[i] != 0 || g_[i] != 0 || b_[i] != 0))
+                    count++;
+            }
+        }
+        return count;
     }
 
-    void display(std::ostream &os, unsigned maxintensity)
+    void display(std::ostream &os, unsigned maxintensity) const
     {
         // Output PPM header
         os << "P3\n";
         os << xres_ << ' ' << yres_ << '\n';
         os << maxintensity << '\n';
 
-        // Now the pixel data
-        for (unsigned i = 0; i < xres_ * yres_; i++)
+        // Now the pixel data, untouched tiles are still black
+        for (unsigned y = 0; y < yres_; y++)
         {
-            os << static_cast<unsigned>(r_[i] * maxintensity) << ' ';
-            os << static_cast<unsigned>(g_[i] * maxintensity) << ' ';
-            os << static_cast<unsigned>(b_[i] * maxintensity) << '\n';
+            for (unsigned x = 0; x < xres_; x++)
+            {
+                unsigned i = y * xres_ + x;
+                bool cleared = tileCleared_[(y / TILE_SIZE) * xtiles_ + x / TILE_SIZE];
+                os << static_cast<unsigned>((cleared ? 0 : r_[i]) * maxintensity) << ' ';
+                os << static_cast<unsigned>((cleared ? 0 : g_[i]) * maxintensity) << ' ';
+                os << static_cast<unsigned>((cleared ? 0 : b_[i]) * maxintensity) << '\n';
+            }
         }
     }
 
 
+    void colorClamp(float &r, float &g, float &b)
+    {
+        zeroOneClamp(r);
+        zeroOneClamp(g);
+        zeroOneClamp(b);
+    }
+
+    void zeroOneClamp(float &x)
+    {
+        if (x < 0)
+            x = 0;
+        else if (x > 1)
+            x = 1;
+    }
+
 private:
     float xmin_, xmax_;
     float ymin_, ymax_;
     unsigned xres_, yres_;
+    // Number of tiles in each direction, edge tiles may be partial
+    unsigned xtiles_, ytiles_;
 
     float *r_;
     float *g_;
     float *b_;
+    float *z_;
+
+    // True for each tile that has been cleared but not yet written to
+    bool *tileCleared_;
+    // Nearest and farthest depth stored in each tile, and how many of the
+    // tile's pixels are at the farthest depth
+    float *tileZMin_;
+    float *tileZMax_;
+    unsigned *tileZMaxCount_;
+
+    // Keeps the tile depth summaries up to date when a pixel's depth goes
+    // from old to key.  Depth writes only ever move pixels nearer, so the
+    // minimum is exact, and the maximum only needs recomputing when the last
+    // pixel at the farthest depth moves.
+    void updateTileDepth(unsigned x, unsigned y, float old, float key)
+    {
+        unsigned tx = x / TILE_SIZE, ty = y / TILE_SIZE;
+        unsigned t = ty * xtiles_ + tx;
+        if (key < tileZMin_[t])
+            tileZMin_[t] = key;
+        if (old != tileZMax_[t] || key == old || --tileZMaxCount_[t] > 0)
+            return;
+
+        unsigned xend = std::min((tx + 1) * TILE_SIZE, xres_);
+        unsigned yend = std::min((ty + 1) * TILE_SIZE, yres_);
+        float zmax = -HUGE_VAL;
+        unsigned count = 0;
+        for (unsigned py = ty * TILE_SIZE; py < yend; py++)
+        {
+            for (unsigned px = tx * TILE_SIZE; px < xend; px++)
+            {
+                float d = z_[py * xres_ + px];
+                if (d > zmax)
+                {
+                    zmax = d;
+                    count = 0;
+                }
+                if (d == zmax)
+                    count++;
+            }
+        }
+        tileZMax_[t] = zmax;
+        tileZMaxCount_[t] = count;
+    }
+
+    // Called before writing pixel (x, y).  If the pixel's tile is still
+    // cleared, fills it with black and infinite z and returns
+    // true.  Otherwise returns false.
+    bool touchTile(unsigned x, unsigned y)
+    {
+        unsigned tx = x / TILE_SIZE, ty = y / TILE_SIZE;
+        unsigned t = ty * xtiles_ + tx;
+        if (!tileCleared_[t])
+            return false;
+
+        unsigned xend = std::min((tx + 1) * TILE_SIZE, xres_);
+        unsigned yend = std::min((ty + 1) * TILE_SIZE, yres_);
+        for (unsigned py = ty * TILE_SIZE; py < yend; py++)
+        {
+            for (unsigned px = tx * TILE_SIZE; px < xend; px++)
+            {
+                unsigned i = py * xres_ + px;
+                r_[i] = g_[i] = b_[i] = 0.0f;
+                z_[i] = HUGE_VAL;
+            }
+        }
+        tileCleared_[t] = false;
+        tileZMin_[t] = tileZMax_[t] = HUGE_VAL;
+        tileZMaxCount_[t] = (xend - tx * TILE_SIZE) * (yend - ty * TILE_SIZE);
+
+        return true;
+    }
 };
 
@@ -0,0 +1,147 @@
+#pragma once
+#include <cassert>
+#include <algorithm>
+#include "canvas.h"
+
+// One per thread, so views can be rasterized in parallel
+static thread_local const Canvas *canv;
+
+// The most floats of data a vertex can carry
+static const unsigned MAX_VERTEX_DATA = 16;
+
+struct vertex
+{
+    float data[MAX_VERTEX_DATA];
+    unsigned num_data;
+};
+struct rasterCoord
+{
+    int x, y;
+};
+
+void initRaster(const Canvas *c)
+{
+    canv = c;
+}
+
+static int f(rasterCoord vert0, rasterCoord vert1, int x, int y)
+{
+    int x0 = vert0.x;
+    int y0 = vert0.y;
+    int x1 = vert1.x;
+    int y1 = vert1.y;
+    return (y0 - y1) * x + (x1 - x0) * y + x0 * y1 - x1 * y0;
+}
+
+// The fragment processor template needs to support function call notation
+// with signature void (int, int, float*).  The two int arguments are the
+// pixel coordinates and the float* is arbitrary data, except that data[2]
+// must be the NDC z coordinate; it is used to skip the tiles the triangle is
+// completely hidden in.
+    template<typename fragmentProcessor>
+void rasterizeTriangle(vertex verts[3], fragmentProcessor fp)
+{
+    // Make sure the vertices all have the same amount of data
+    assert(verts[0].num_data == verts[1].num_data &&
+            verts[0].num_data == verts[2].num_data);
+    assert(verts[0].num_data <= MAX_VERTEX_DATA);
+    // Pixel coordinates for a bounding box
+    int xMin, xMax, yMin, yMax;
+    // High enough that it doesn't matter
+    xMin = canv->getXRes() + 1; yMin = canv->getYRes() + 1;
+    // Low enough that it doesn't matter
+    xMax = yMax = -1;
+
+    // Each vertex's x and y in pixel coordinates
+    rasterCoord coords[3];
+
+    // do the conversion
+    for (int i = 0; i < 3; i++)
+    {
+        coords[i].x = canv->getPixelX(verts[i].data[0]);
+        coords[i].y = canv->getPixelY(verts[i].data[1]);
+    }
+
+    // find the bounding box
+    for (int i = 0; i < 3; i++)
+    {
+        if (coords[i].x < xMin)
+            xMin = coords[i].x;
+        if (coords[i].y < yMin)
+            yMin = coords[i].y;
+        if (coords[i].x > xMax)
+            xMax = coords[i].x;
+        if (coords[i].y > yMax)
+            yMax = coords[i].y;
+    }
+
+    // Clamp to canvas dimensions
+    if (xMax > canv->getXRes()-1)
+        xMax = canv->getXRes() - 1;
+    if (yMax > canv->getYRes()-1)
+        yMax = canv->getYRes() - 1;
+
+    // normalizing values for the barycentric coordinates
+    float fAlpha, fBeta, fGamma;
+
+    // not sure exactly what's going on here, so read the textbook
+    fAlpha = f(coords[1], coords[2], coords[0].x, coords[0].y);
+    fBeta = f(coords[2], coords[0], coords[1].x, coords[1].y);
+    fGamma = f(coords[0], coords[1], coords[2].x, coords[2].y);
+
+    // check for zero denominators. if found, these indicate a degenerate
+    // triangle which should not be drawn, so just return.
+    if(fabs(fAlpha) < .0001 || fabs(fBeta) < .0001 || fabs(fGamma) < .0001)
+    {
+        if (stats)
+            stats->degenerate++;
+        return;
+    }
+
+    // The nearest depth on the triangle
+    float zMin = std::min(verts[0].data[2], std::min(verts[1].data[2], verts[2].data[2]));
+
+    int numData = verts[0].num_data;
+    float data[MAX_VERTEX_DATA];
+    int xStart = (xMin > 0) ? xMin : 0;
+    int yStart = (yMin > 0) ? yMin : 0;
+    // go over every tile in the bounding box
+    for (int ty = yStart / TILE_SIZE; ty * (int)TILE_SIZE < yMax; ty++)
+    {
+        for (int tx = xStart / TILE_SIZE; tx * (int)TILE_SIZE < xMax; tx++)
+        {
+            // Skip the whole tile if everything in it is nearer than the triangle
+            if (canv->tileOccludes(tx, ty, zMin))
+                continue;
+
+            // go over every pixel in the bounding box inside this tile
+            int yEnd = std::min(yMax, (ty + 1) * (int)TILE_SIZE);
+            int xEnd = std::min(xMax, (tx + 1) * (int)TILE_SIZE);
+            for (int y = std::max(yStart, ty * (int)TILE_SIZE); y < yEnd; y++)
+            {
+                for (int x = std::max(xStart, tx * (int)TILE_SIZE); x < xEnd; x++)
+                {
+                    // calculate the pixel's barycentric coordinates
+                    float alpha = f(coords[1], coords[2], x, y) / fAlpha;
+                    float beta = f(coords[2], coords[0], x, y) / fBeta;
+                    float gamma = f(coords[0], coords[1], x, y) / fGamma;
+
+                    // if the coordinates are positive, do the next check
+                    if (alpha >= 0 && beta >= 0 && gamma >= 0)
+                    {
+                        // interpolate all data
+                        for (int i = 0; i < numData; i++)
+                        {
+                            data[i] = (alpha * verts[0].data[i] +
+                                    beta * verts[1].data[i] +
+                                    gamma * verts[2].data[i]);
+                        }
+
+                        // and finally, draw the pixel
+                        fp(x, y, data);
+                    }
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,81 @@
+#include <iostream>
+#include <cstdlib>
+#include "wireframe.h"
+#include "transforms.h"
+#include "scenefile.h"
+
+void parse_file(std::istream &input, Scene *output);
+
+/**
+ * Reads a scene from input, which can be either an Open Inventor text file or
+ * a binary scene file (scenefile.h).  fd is input's file descriptor, or -1;
+ * binary files on a regular file descriptor are mapped instead of read.
+ * Lights, materials and normals in a scene file are skipped, as they are when
+ * parsing.
+ */
+void read_scene(std::istream &input, int fd, Scene *output)
+{
+    if (!isSceneFile(input))
+    {
+        parse_file(input, output);
+        return;
+    }
+
+    sceneFile file;
+    if (!file.load(input, fd))
+    {
+        std::cerr << "Not a scene file this can read\n";
+        exit(1);
+    }
+    const sceneFileHeader &h = file.header();
+
+    const sceneFileCamera *cameras = file.array<sceneFileCamera>(h.camerasOffset, h.numCameras);
+    for (unsigned i = 0; i < h.numCameras; i++)
+    {
+        const sceneFileCamera &c = cameras[i];
+        Camera cam;
+        cam.position = makeVector3(c.position[0], c.position[1], c.position[2]);
+        cam.orientation = makeVector4(c.orientation[0], c.orientation[1], c.orientation[2], c.orientation[3]);
+        cam.nearDistance = c.nearDistance;
+        cam.farDistance = c.farDistance;
+        cam.left = c.left;
+        cam.right = c.right;
+        cam.top = c.top;
+        cam.bottom = c.bottom;
+        output->cameras.push_back(cam);
+        output->camera = cam;
+    }
+
+    const sceneFileSeparator *seps = file.array<sceneFileSeparator>(h.separatorsOffset, h.numSeparators);
+    output->separators.resize(h.numSeparators);
+    for (unsigned s = 0; s < h.numSeparators; s++)
+    {
+        const sceneFileSeparator &in = seps[s];
+        Separator &sep = output->separators[s];
+
+        const sceneFileTransform *transforms = file.array<sceneFileTransform>(in.transformsOffset, in.numTransforms);
+        const float *points = file.array<float>(in.pointsOffset, in.numPoints * 3ull);
+        const int32_t *indices = file.array<int32_t>(in.indicesOffset, in.numIndices);
+        if (!transforms || !points || !indices)
+        {
+            std::cerr << "Scene file is truncated\n";
+            exit(1);
+        }
+
+        // Multiplied together like the parser does
+        sep.transform = make_identity<float, 4>();
+        for (unsigned i = 0; i < in.numTransforms; i++)
+        {
+            const sceneFileTransform &t = transforms[i];
+            sep.transform = sep.transform *
+                make_translation(t.translation[0], t.translation[1], t.translation[2]) *
+                make_rotation(t.rotation[0], t.rotation[1], t.rotation[2], t.rotation[3]) *
+                make_scaling(t.scaling[0], t.scaling[1], t.scaling[2]);
+        }
+
+        sep.points.resize(in.numPoints);
+        for (unsigned i = 0; i < in.numPoints; i++)
+            sep.points[i] = makeVector3(points[3*i], points[3*i+1], points[3*i+2]);
+        sep.indices.assign(indices, indices + in.numIndices);
+    }
+}
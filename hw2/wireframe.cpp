@@ -1,119 +1,633 @@
 #include <fstream>
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <unordered_set>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
 #include "wireframe.h"
 #include "canvas.h"
 #include "matrix.h"
 #include "transforms.h"
+#include "raster.h"
+#include "stats.h"
 
-void parse_file(std::istream &input, Scene *output);
+void read_scene(std::istream &input, int fd, Scene *output);
 
 void print_scene_info(const Scene &scene);
-void render_scene(const Scene &scene, Canvas &canv);
-Matrix4 worldToNDCMatrix(const Scene &scene);
-void rasterizeEdge(const Vector3 &, const Vector3 &, const Matrix4 &, Canvas &);
+void build_edges(Separator &sep);
+void compute_bounds(Separator &sep);
+bool outside_frustum(const Separator &sep, const Matrix4 &objectToClip);
+void transform_to_world(const Scene &scene, std::vector<std::vector<Vector4> > &worldCoords);
+void render_scene(const Scene &scene, const std::vector<std::vector<Vector4> > &worldCoords,
+        const Matrix4 &viewProjectionMatrix, Canvas &canv, bool hidden);
+void render_depth(const Separator &sep, const std::vector<Vector4> &clipCoords, Canvas &canv);
+bool render_views(const Scene &scene, const std::vector<std::vector<Vector4> > &worldCoords,
+        const std::vector<Matrix4> &views, unsigned xRes, unsigned yRes, bool hidden,
+        const std::string &prefix);
+std::vector<Matrix4> orbitViews(const Scene &scene, const std::vector<std::vector<Vector4> > &worldCoords, int n);
+Matrix4 worldToNDCMatrix(const Camera &cam);
+bool clipEdge(Vector4 &, Vector4 &);
+int clipNear(Vector4 pos[], int n);
+void rasterizeEdge(const Vector4 &, const Vector4 &, Canvas &, bool hidden);
+void report_stats(const char *filename);
+
+// Outcode bits of a clip space position, set for each plane of the view
+// frustum it is outside of
+static const int OUT_LEFT = 1;
+static const int OUT_RIGHT = 2;
+static const int OUT_BOTTOM = 4;
+static const int OUT_TOP = 8;
+static const int OUT_NEAR = 16;
+static const int OUT_FAR = 32;
+static const int OUT_FRUSTUM = OUT_LEFT | OUT_RIGHT | OUT_BOTTOM | OUT_TOP | OUT_NEAR | OUT_FAR;
+
+// Clipping a triangle against one plane adds at most one vertex
+static const int MAX_CLIP_VERTS = 4;
+
+renderStats *stats = NULL;
+// Batch mode views add their times to the stats from several threads
+static std::mutex statsMutex;
+
+// How far, in NDC z, a hidden line mode edge may be behind the z buffer and
+// still be drawn
+static const float HIDDEN_LINE_BIAS = 0.01f;
+
+static void usage()
+{
+    std::cerr << "usage: wireframe xRes yRes [-hidden] [-cameras file.iv] [-orbit n] [-o prefix] [-stats file.json]\n";
+    exit(1);
+}
 
 int main(int argc, char **argv)
 {
-    if (argc != 3)
-    {
-        std::cerr << "usage: wireframe xRes yRes\n";
-        exit(1);
-    }
+    if (argc < 3)
+        usage();
     unsigned xRes, yRes;
     xRes = atof(argv[1]);
     yRes = atof(argv[2]);
 
+    // Hidden line removal
+    bool hidden = false;
+    // Batch mode options, every camera in cameraFile and/or orbit views
+    // around the scene are rendered to prefixNNN.ppm
+    const char *cameraFile = NULL;
+    int orbit = 0;
+    std::string prefix = "view";
+    const char *statsFile = NULL;
+    for (int i = 3; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-hidden") == 0)
+            hidden = true;
+        else if (strcmp(argv[i], "-cameras") == 0 && i + 1 < argc)
+            cameraFile = argv[++i];
+        else if (strcmp(argv[i], "-orbit") == 0 && i + 1 < argc)
+            orbit = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            prefix = argv[++i];
+        else if ((strcmp(argv[i], "-stats") == 0 || strcmp(argv[i], "--stats") == 0) && i + 1 < argc)
+            statsFile = argv[++i];
+        else
+            usage();
+    }
+
+    renderStats collected;
+    if (statsFile)
+        stats = &collected;
+
+    double start = statsClock();
     Scene scene;
-    parse_file(std::cin, &scene);
+    read_scene(std::cin, 0, &scene);
+    for (unsigned i = 0; i < scene.separators.size(); i++)
+    {
+        build_edges(scene.separators[i]);
+        compute_bounds(scene.separators[i]);
+    }
+    collected.parse = statsClock() - start;
+
+    // Model to world transforms are shared by every view, do them once
+    start = statsClock();
+    std::vector<std::vector<Vector4> > worldCoords;
+    transform_to_world(scene, worldCoords);
+    collected.transform = statsClock() - start;
+
+    if (!cameraFile && orbit <= 0)
+    {
+        // Canvas dimensions are NDC
+        Canvas canv(-1, 1, -1, 1, xRes, yRes);
+
+        //print_scene_info(scene);
+        render_scene(scene, worldCoords, worldToNDCMatrix(scene.camera), canv, hidden);
+
+        //std::fstream file("wireframe.ppm", std::fstream::out);
+        start = statsClock();
+        canv.display(std::cout, 255);
+        std::cout.flush();
+        collected.output = statsClock() - start;
+        //file.close();
+
+        if (stats)
+            collected.pixels = canv.coveredPixels();
+        report_stats(statsFile);
+        return 0;
+    }
+
+    std::vector<Matrix4> views;
+    if (cameraFile)
+    {
+        std::ifstream file(cameraFile, std::ios::binary);
+        if (!file)
+        {
+            std::cerr << "Unable to open camera file " << cameraFile << '\n';
+            exit(1);
+        }
+        // Only the PerspectiveCamera blocks of the file are used
+        Scene cameras;
+        read_scene(file, -1, &cameras);
+        for (unsigned i = 0; i < cameras.cameras.size(); i++)
+            views.push_back(worldToNDCMatrix(cameras.cameras[i]));
+    }
+    if (orbit > 0)
+    {
+        std::vector<Matrix4> orbitMatrices = orbitViews(scene, worldCoords, orbit);
+        views.insert(views.end(), orbitMatrices.begin(), orbitMatrices.end());
+    }
+
+    bool written = render_views(scene, worldCoords, views, xRes, yRes, hidden, prefix);
+
+    report_stats(statsFile);
+    return written ? 0 : 1;
+}
+
+/**
+ * Prints the stats to stderr and writes them as JSON to filename, if they
+ * are being collected.
+ */
+void report_stats(const char *filename)
+{
+    if (!stats)
+        return;
 
-    // Canvas dimensions are NDC
-    Canvas canv(-1, 1, -1, 1, xRes, yRes);
+    stats->print(std::cerr);
+    std::ofstream json(filename);
+    stats->printJSON(json);
+    if (!json)
+        std::cerr << "Couldn't write stats to " << filename << '\n';
+}
+
+/**
+ * Fills in sep.edges from the face indices.  An edge shared by two faces
+ * is only recorded the first time it is seen.
+ */
+void build_edges(Separator &sep)
+{
+    const std::vector<int>& indices = sep.indices;
+    // Key is the sorted index pair packed into 64 bits
+    std::unordered_set<unsigned long long> seen;
+    sep.edges.clear();
 
-    //print_scene_info(scene);
-    render_scene(scene, canv);
+    int firstInd = -1;
+    int prevInd = -1;
+    for (unsigned i = 0; i < indices.size(); i++)
+    {
+        int ind = indices[i];
+        int a, b;
+        // ending index -> edge from prev to first and clear
+        if (ind == -1)
+        {
+            a = prevInd;
+            b = firstInd;
+            firstInd = prevInd = -1;
+        }
+        // First index, no edge yet, just record points
+        else if (firstInd == -1)
+        {
+            firstInd = ind;
+            prevInd = ind;
+            continue;
+        }
+        // Middle indices, edge between prev and current, update prev
+        else
+        {
+            a = prevInd;
+            b = ind;
+            prevInd = ind;
+        }
+
+        if (a > b)
+            std::swap(a, b);
+        unsigned long long key = (static_cast<unsigned long long>(a) << 32) | static_cast<unsigned>(b);
+        if (seen.insert(key).second)
+        {
+            Edge e = {a, b};
+            sep.edges.push_back(e);
+        }
+    }
+}
+
+/**
+ * Fills in the separator's object space bounding box, and a bounding sphere
+ * around the box's center.
+ */
+void compute_bounds(Separator &sep)
+{
+    sep.boxMin = sep.boxMax = sep.sphereCenter = makeVector3(0, 0, 0);
+    sep.sphereRadius = 0;
+    if (sep.points.empty())
+        return;
 
-    //std::fstream file("wireframe.ppm", std::fstream::out);
-    canv.display(std::cout, 255);
-    //file.close();
+    sep.boxMin = sep.boxMax = sep.points[0];
+    for (unsigned i = 1; i < sep.points.size(); i++)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            sep.boxMin(c) = std::min(sep.boxMin(c), sep.points[i](c));
+            sep.boxMax(c) = std::max(sep.boxMax(c), sep.points[i](c));
+        }
+    }
 
-    return 0;
+    sep.sphereCenter = (sep.boxMin + sep.boxMax) / 2.0f;
+    for (unsigned i = 0; i < sep.points.size(); i++)
+        sep.sphereRadius = std::max(sep.sphereRadius, (sep.points[i] - sep.sphereCenter).magnitude());
 }
 
-void render_scene(const Scene &scene, Canvas &canv)
+/**
+ * Returns true if none of the separator can be seen through objectToClip,
+ * the transform from its object space to clip space.  The bounding sphere is
+ * tested against the frustum's planes first, and if that doesn't settle it
+ * the bounding box's corners are.  It only ever errs towards drawing.
+ */
+bool outside_frustum(const Separator &sep, const Matrix4 &objectToClip)
 {
-    Matrix4 viewProjectionMatrix = worldToNDCMatrix(scene);
+    if (sep.points.empty())
+        return true;
 
-    std::vector<Separator>::const_iterator it = scene.separators.begin();
-    for (; it != scene.separators.end(); it++)
+    // The frustum's planes in object space are w + x >= 0, w - x >= 0 and so
+    // on for y and z, which are sums of rows of objectToClip
+    const Matrix4 &m = objectToClip;
+    const Vector3 &center = sep.sphereCenter;
+    for (int p = 0; p < 6; p++)
     {
-        //std::cout << "Model to world space matrix:\n" << it->transform;
-        Matrix4 modelViewProjectionMatrix = viewProjectionMatrix * it->transform;
-        const std::vector<Vector3>& points = it->points;
-        const std::vector<int>& indices = it->indices;
+        int row = p / 2;
+        float sign = (p & 1) ? -1 : 1;
+        float a = m(3, 0) + sign * m(row, 0);
+        float b = m(3, 1) + sign * m(row, 1);
+        float c = m(3, 2) + sign * m(row, 2);
+        float d = m(3, 3) + sign * m(row, 3);
+        float dist = a * center(0) + b * center(1) + c * center(2) + d;
+        if (dist < -sep.sphereRadius * sqrtf(a * a + b * b + c * c))
+            return true;
+    }
 
-        //std::cout << "Full transform matrix:\n" << modelViewProjectionMatrix;
+    // Outside if every corner of the box is outside the same plane
+    int outside = OUT_FRUSTUM;
+    for (int i = 0; i < 8 && outside; i++)
+    {
+        Vector4 corner = m * makeVector4((i & 1) ? sep.boxMax(0) : sep.boxMin(0),
+                (i & 2) ? sep.boxMax(1) : sep.boxMin(1),
+                (i & 4) ? sep.boxMax(2) : sep.boxMin(2), 1);
+        float x = corner(0), y = corner(1), z = corner(2), w = corner(3);
+        outside &= (x < -w ? OUT_LEFT : 0) | (x > w ? OUT_RIGHT : 0) |
+            (y < -w ? OUT_BOTTOM : 0) | (y > w ? OUT_TOP : 0) |
+            (z < -w ? OUT_NEAR : 0) | (z > w ? OUT_FAR : 0);
+    }
+    return outside != 0;
+}
 
-        int firstInd = -1;
-        int prevInd = -1;
-        for (unsigned i = 0; i < indices.size(); i++)
+/**
+ * Transforms the points of every separator to world space.
+ */
+void transform_to_world(const Scene &scene, std::vector<std::vector<Vector4> > &worldCoords)
+{
+    worldCoords.resize(scene.separators.size());
+    for (unsigned s = 0; s < scene.separators.size(); s++)
+    {
+        const Separator &sep = scene.separators[s];
+        //std::cout << "Model to world space matrix:\n" << sep.transform;
+        worldCoords[s].resize(sep.points.size());
+        for (unsigned i = 0; i < sep.points.size(); i++)
+            worldCoords[s][i] = sep.transform * homogenize(sep.points[i]);
+    }
+}
+
+/**
+ * Draws every edge of the scene as seen through viewProjectionMatrix.  In
+ * hidden line mode the faces are first rendered into the z buffer and only
+ * the parts of edges that aren't behind them are drawn.
+ */
+void render_scene(const Scene &scene, const std::vector<std::vector<Vector4> > &worldCoords,
+        const Matrix4 &viewProjectionMatrix, Canvas &canv, bool hidden)
+{
+    initRaster(&canv);
+    double start = statsClock();
+
+    // Transform every point once, edges and the depth pass share them.
+    // Separators that are entirely off screen are left empty and skipped.
+    std::vector<std::vector<Vector4> > clipCoords(scene.separators.size());
+    for (unsigned s = 0; s < scene.separators.size(); s++)
+    {
+        if (outside_frustum(scene.separators[s], viewProjectionMatrix * scene.separators[s].transform))
         {
-            int ind = indices[i];
-            // ending index -> draw from prev to first and clear
-            if (ind == -1)
+            if (stats)
+                stats->lines += scene.separators[s].edges.size();
+            continue;
+        }
+        clipCoords[s].resize(worldCoords[s].size());
+        for (unsigned i = 0; i < worldCoords[s].size(); i++)
+            clipCoords[s][i] = viewProjectionMatrix * worldCoords[s][i];
+    }
+    double transformed = statsClock();
+
+    if (hidden)
+        for (unsigned s = 0; s < scene.separators.size(); s++)
+            if (!clipCoords[s].empty())
+                render_depth(scene.separators[s], clipCoords[s], canv);
+
+    for (unsigned s = 0; s < scene.separators.size(); s++)
+    {
+        if (clipCoords[s].empty())
+            continue;
+        const std::vector<Edge>& edges = scene.separators[s].edges;
+        for (unsigned i = 0; i < edges.size(); i++)
+            rasterizeEdge(clipCoords[s][edges[i].a], clipCoords[s][edges[i].b], canv, hidden);
+    }
+
+    if (stats)
+    {
+        double end = statsClock();
+        std::lock_guard<std::mutex> lock(statsMutex);
+        stats->transform += transformed - start;
+        stats->raster += end - transformed;
+    }
+}
+
+/**
+ * Renders each view to its own image, prefix000.ppm, prefix001.ppm, ...
+ * Views are handed out to one thread per core.  Returns false if any image
+ * couldn't be written.
+ */
+bool render_views(const Scene &scene, const std::vector<std::vector<Vector4> > &worldCoords,
+        const std::vector<Matrix4> &views, unsigned xRes, unsigned yRes, bool hidden,
+        const std::string &prefix)
+{
+    std::atomic<unsigned> next(0);
+    std::atomic<bool> written(true);
+    std::mutex errorMutex;
+    unsigned numThreads = std::max(1u, std::thread::hardware_concurrency());
+    numThreads = std::min<unsigned>(numThreads, views.size());
+
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < numThreads; t++)
+    {
+        threads.push_back(std::thread([&]()
+        {
+            for (unsigned v = next++; v < views.size(); v = next++)
             {
-                // draw a line between points[prevInd] and points[firstInd]
-                rasterizeEdge(points[prevInd], points[firstInd], modelViewProjectionMatrix, canv);
-                firstInd = prevInd = -1;
-                continue;
+                Canvas canv(-1, 1, -1, 1, xRes, yRes);
+                render_scene(scene, worldCoords, views[v], canv, hidden);
+
+                char filename[16];
+                snprintf(filename, sizeof(filename), "%03u.ppm", v);
+                double start = statsClock();
+                std::ofstream file((prefix + filename).c_str());
+                canv.display(file, 255);
+                file.close();
+                if (!file)
+                {
+                    std::lock_guard<std::mutex> lock(errorMutex);
+                    std::cerr << "Unable to write " << prefix << filename << '\n';
+                    written = false;
+                }
+
+                if (stats)
+                {
+                    stats->pixels += canv.coveredPixels();
+                    std::lock_guard<std::mutex> lock(statsMutex);
+                    stats->output += statsClock() - start;
+                }
             }
-            // First index, don't draw a line, just record points
-            if (firstInd == -1)
+        }));
+    }
+    for (unsigned t = 0; t < threads.size(); t++)
+        threads[t].join();
+    return written;
+}
+
+/**
+ * Returns n views of a turntable around the scene.  The scene's camera
+ * orbits the vertical axis through the center of the scene's bounding box,
+ * 360/n degrees between each view, starting from where it is.
+ */
+std::vector<Matrix4> orbitViews(const Scene &scene, const std::vector<std::vector<Vector4> > &worldCoords, int n)
+{
+    Vector3 minCoord = makeVector3(HUGE_VAL, HUGE_VAL, HUGE_VAL);
+    Vector3 maxCoord = makeVector3(-HUGE_VAL, -HUGE_VAL, -HUGE_VAL);
+    for (unsigned s = 0; s < worldCoords.size(); s++)
+    {
+        for (unsigned i = 0; i < worldCoords[s].size(); i++)
+        {
+            for (int j = 0; j < 3; j++)
             {
-                firstInd = ind;
-                prevInd = ind;
+                float c = worldCoords[s][i](j) / worldCoords[s][i](3);
+                minCoord(j) = std::min(minCoord(j), c);
+                maxCoord(j) = std::max(maxCoord(j), c);
             }
-            // Middle indices, draw a line between prev and current, update prev
-            else
+        }
+    }
+    Vector3 center = worldCoords.empty() ? makeVector3(0, 0, 0) : (minCoord + maxCoord) / 2.0f;
+
+    const Matrix4 viewProjectionMatrix = worldToNDCMatrix(scene.camera);
+    std::vector<Matrix4> views;
+    for (int i = 0; i < n; i++)
+    {
+        // Moving the camera by angle around the center is the same as moving
+        // the world by -angle
+        float angle = 2 * M_PI * i / n;
+        Matrix4 spin = make_translation(center(0), center(1), center(2)) *
+            make_rotation(0, 1, 0, -angle) *
+            make_translation(-center(0), -center(1), -center(2));
+        views.push_back(viewProjectionMatrix * spin);
+    }
+
+    return views;
+}
+
+/**
+ * This fragment processor only fills in the z buffer.  It expects data[2] to
+ * be the ndc z coordinate.
+ */
+struct depth_shader
+{
+    depth_shader(Canvas &canv) : canvas(canv) {}
+
+    void operator()(int x, int y, float *data)
+    {
+        canvas.drawDepth(x, y, data[2]);
+    }
+
+private:
+    Canvas &canvas;
+};
+
+/**
+ * Fan triangulates the faces of sep and rasterizes them into the z buffer.
+ * Both sides of a face hide what is behind them, so there is no backface
+ * culling.  Triangles crossing the near plane are clipped to it, so an
+ * occluder reaching behind the camera still hides what it covers.
+ */
+void render_depth(const Separator &sep, const std::vector<Vector4> &clipCoords, Canvas &canv)
+{
+    const std::vector<int>& indices = sep.indices;
+
+    vertex verts[3];
+    for (int i = 0; i < 3; i++)
+        verts[i].num_data = 3;
+
+    int firstInd = -1;
+    int prevInd = -1;
+    for (unsigned i = 0; i < indices.size(); i++)
+    {
+        int ind = indices[i];
+        // ending index -> reset
+        if (ind == -1)
+            firstInd = prevInd = -1;
+        // first index -> just record index
+        else if (firstInd == -1)
+            firstInd = ind;
+        // first index recorded, but not second -> just record second
+        else if (prevInd == -1)
+            prevInd = ind;
+        // both first and second indices recorded -> rasterize triangle
+        else
+        {
+            Vector4 pos[MAX_CLIP_VERTS] = {clipCoords[firstInd], clipCoords[prevInd], clipCoords[ind]};
+            prevInd = ind;
+            if (stats)
+                stats->triangles++;
+
+            int n = clipNear(pos, 3);
+            if (n < 3)
+            {
+                if (stats)
+                    stats->frustumCulled++;
+                continue;
+            }
+
+            // Whatever is left is in front of the camera, draw it as a fan
+            for (int j = 1; j + 1 < n; j++)
             {
-                // draw a line between points[prevInd] and points[ind]
-                rasterizeEdge(points[prevInd], points[ind], modelViewProjectionMatrix, canv);
+                const Vector4 *tri[3] = {&pos[0], &pos[j], &pos[j + 1]};
+                for (int v = 0; v < 3; v++)
+                    for (int k = 0; k < 3; k++)
+                        verts[v].data[k] = (*tri[v])(k) / (*tri[v])(3);
 
-                prevInd = ind;
+                rasterizeTriangle(verts, depth_shader(canv));
             }
         }
     }
 }
 
-void rasterizeEdge(const Vector3& a, const Vector3& b, const Matrix4& fullTransform, Canvas &canv)
+/**
+ * Clips the clip space polygon pos, n vertices, against the near plane
+ * z >= -w, as Sutherland-Hodgman does and as hw3's clip_polygon does for
+ * all its planes.  The result replaces the input and its vertex count is
+ * returned; under 3 means nothing is left.  Everything in front of the near
+ * plane has w > 0, so what is left can be divided by w.
+ */
+int clipNear(Vector4 pos[], int n)
 {
-    // extend to homogenized coords
-    Vector4 ah, bh;
-    ah(0) = a(0); ah(1) = a(1); ah(2) = a(2); ah(3) = 1;
-    bh(0) = b(0); bh(1) = b(1); bh(2) = b(2); bh(3) = 1;
+    // Signed distance of each vertex from the plane, inside is positive
+    float dist[MAX_CLIP_VERTS];
+    for (int i = 0; i < n; i++)
+        dist[i] = pos[i](3) + pos[i](2);
 
-    //std::cout << "Pre transform (" << ah(0) << ' ' << ah(1) << ' ' << ah(2) << ") to (" <<
-        //bh(0) << ' ' << bh(1) << ' ' << bh(2) << ")\n";
+    Vector4 out[MAX_CLIP_VERTS];
+    int numOut = 0;
+    for (int i = 0; i < n; i++)
+    {
+        int j = (i + 1) % n;
+        if (dist[i] >= 0)
+            out[numOut++] = pos[i];
+        // The edge crosses the plane, add the crossing point
+        if ((dist[i] >= 0) != (dist[j] >= 0))
+        {
+            float t = dist[i] / (dist[i] - dist[j]);
+            out[numOut++] = pos[i] + (pos[j] - pos[i]) * t;
+        }
+    }
+
+    std::copy(out, out + numOut, pos);
+    return numOut;
+}
+
+/**
+ * Clips the clip space edge a-b against the view frustum, -w <= x, y, z <= w,
+ * using Liang-Barsky.  Returns false if none of the edge is visible,
+ * otherwise moves a and b to the ends of the visible part.
+ */
+bool clipEdge(Vector4 &a, Vector4 &b)
+{
+    // Signed distances to each plane, inside when >= 0
+    float da[6], db[6];
+    for (int i = 0; i < 3; i++)
+    {
+        da[2*i]   = a(3) + a(i);
+        da[2*i+1] = a(3) - a(i);
+        db[2*i]   = b(3) + b(i);
+        db[2*i+1] = b(3) - b(i);
+    }
+
+    float t0 = 0, t1 = 1;
+    for (int i = 0; i < 6; i++)
+    {
+        // Both ends outside the same plane -> trivially rejected
+        if (da[i] < 0 && db[i] < 0)
+            return false;
+        if (da[i] < 0)
+            t0 = std::max(t0, da[i] / (da[i] - db[i]));
+        else if (db[i] < 0)
+            t1 = std::min(t1, da[i] / (da[i] - db[i]));
+    }
+    if (t0 > t1)
+        return false;
+
+    // Both ends inside, nothing to do
+    if (t0 == 0 && t1 == 1)
+        return true;
+
+    Vector4 d = b - a;
+    b = a + d * t1;
+    a = a + d * t0;
+    return true;
+}
+
+void rasterizeEdge(const Vector4& a, const Vector4& b, Canvas &canv, bool hidden)
+{
+    if (stats)
+        stats->lines++;
 
-    // Transform to NDC
-    ah = fullTransform * ah;
-    bh = fullTransform * bh;
+    // Clip before dividing, points behind the camera have w < 0
+    Vector4 ac = a, bc = b;
+    if (!clipEdge(ac, bc))
+        return;
 
     // re homogenize
-    ah /= ah(3);
-    bh /= bh(3);
+    Vector4 ah = ac / ac(3);
+    Vector4 bh = bc / bc(3);
 
     //std::cout << "Drawing from (" << ah(0) << ' ' << ah(1) << ' ' << ah(2) << ") to (" <<
         //bh(0) << ' ' << bh(1) << ' ' << bh(2) << ")\n";
 
-    canv.drawLine(ah(0), ah(1), bh(0), bh(1));
+    canv.drawLine(ah(0), ah(1), ah(2), bh(0), bh(1), bh(2), hidden ? HIDDEN_LINE_BIAS : HUGE_VAL);
 }
 
-Matrix4 worldToNDCMatrix(const Scene &scene)
+Matrix4 worldToNDCMatrix(const Camera &cam)
 {
-    const Camera &cam = scene.camera;
-    const Vector3 &pos = scene.camera.position;
-    const Vector4 &rot = scene.camera.orientation;
+    const Vector3 &pos = cam.position;
+    const Vector4 &rot = cam.orientation;
 
     // world to camera
     // C^-1 = R^-1 * T^-1
@@ -14,15 +14,30 @@ struct Camera
     float bottom;
 };
 
+// An edge between two points of a separator, a < b
+struct Edge
+{
+    int a, b;
+};
+
 struct Separator
 {
     Matrix4 transform;
     std::vector<Vector3> points;
     std::vector<int> indices;
+
+    // Each edge of the face set exactly once, filled in by build_edges
+    std::vector<Edge> edges;
+    // Object space bounds of the points, filled in by compute_bounds
+    Vector3 boxMin, boxMax;
+    Vector3 sphereCenter;
+    float sphereRadius;
 };
 
 struct Scene
 {
+    // The last camera in the file, and all of them in order
     Camera camera;
+    std::vector<Camera> cameras;
     std::vector<Separator> separators;
 };
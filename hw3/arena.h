@@ -0,0 +1,92 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+/**
+ * Bump allocator for memory that only needs to live for one render pass, or
+ * part of one.  Allocating is a pointer bump, nothing is freed on its own,
+ * and reset() makes everything available again while keeping the blocks, so
+ * once a pass has warmed the arena up it does no heap allocation at all.
+ *
+ * Memory comes back uninitialized and destructors are never run, so only
+ * put things here that don't need them.
+ */
+class arena
+{
+public:
+    explicit arena(size_t blockSize = 1 << 20) :
+        blockSize_(blockSize),
+        current_(0),
+        used_(0)
+    {}
+
+    ~arena()
+    {
+        for (unsigned i = 0; i < blocks_.size(); i++)
+            free(blocks_[i].data);
+    }
+
+    // Returns bytes bytes aligned to align, which must be a power of two no
+    // bigger than 16
+    void *allocate(size_t bytes, size_t align = 16)
+    {
+        for (;;)
+        {
+            if (current_ < blocks_.size())
+            {
+                size_t start = (used_ + align - 1) & ~(align - 1);
+                if (start + bytes <= blocks_[current_].size)
+                {
+                    used_ = start + bytes;
+                    return blocks_[current_].data + start;
+                }
+                // Doesn't fit, move on to the next block
+                current_++;
+                used_ = 0;
+                continue;
+            }
+
+            // Out of blocks, malloc's memory is always 16 byte aligned
+            block b;
+            b.size = std::max(blockSize_, bytes);
+            b.data = static_cast<char *>(malloc(b.size));
+            if (!b.data)
+                throw std::bad_alloc();
+            blocks_.push_back(b);
+        }
+    }
+
+    // Returns uninitialized space for n Ts
+    template<typename T>
+    T *allocateArray(size_t n)
+    {
+        return static_cast<T *>(allocate(n * sizeof(T), std::max<size_t>(alignof(T), 1)));
+    }
+
+    // Frees everything at once
+    void reset()
+    {
+        current_ = 0;
+        used_ = 0;
+    }
+
+private:
+    struct block
+    {
+        char *data;
+        size_t size;
+    };
+
+    size_t blockSize_;
+    std::vector<block> blocks_;
+    // The block being allocated from, and how much of it is used
+    unsigned current_;
+    size_t used_;
+
+    // Not copyable
+    arena(const arena &);
+    arena &operator=(const arena &);
+};
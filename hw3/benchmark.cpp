@@ -0,0 +1,356 @@
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <iterator>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include "stats.h"
+
+// What gets rendered: every scene in every shading mode at every resolution
+static const char *SCENES[] = {"sphere", "lion1", "lion2", "fourCubes", "cube2", "cube3", "cubeClip",
+    "emptySeps"};
+static const int NUM_SCENES = sizeof(SCENES) / sizeof(SCENES[0]);
+static const int NUM_MODES = 3;
+static const int RESOLUTIONS[] = {128, 256, 512};
+static const int NUM_RESOLUTIONS = sizeof(RESOLUTIONS) / sizeof(RESOLUTIONS[0]);
+
+// Where the reference images and timings live
+static const char *REFERENCE_DIR = "bench";
+static const char *TIMINGS_FILE = "bench/timings";
+
+// Single renders take milliseconds, so one being this much slower than
+// recorded is only pointed out.  Only the total render time fails the run.
+static const double NOTE_SLOWDOWN = 1.5;
+static const double NOTE_SLACK = 0.005;
+// The total also has to be at least this many seconds over what was recorded
+// to fail, so that a fast machine's small total isn't failed by noise
+static const double TOTAL_SLACK = 0.05;
+
+struct image
+{
+    int xres, yres;
+    std::vector<unsigned char> pixels;
+};
+
+struct result
+{
+    image img;
+    // Wall time of the whole run, and of just transforming, rasterizing and
+    // shading, in seconds
+    double wall;
+    double render;
+};
+
+static void usage()
+{
+    std::cerr << "usage: benchmark [-update | -retime] [-runs n] [-tolerance n] [-mismatch fraction] [-slowdown factor]\n";
+    exit(1);
+}
+
+/**
+ * Reads a P3 or P6 image from file.  Returns false if it isn't one.
+ */
+bool read_ppm(FILE *file, image &img)
+{
+    char magic[3] = {0};
+    int maxval;
+    if (fscanf(file, "%2s %d %d %d", magic, &img.xres, &img.yres, &maxval) != 4 || maxval != 255)
+        return false;
+
+    img.pixels.resize(img.xres * img.yres * 3);
+    if (strcmp(magic, "P6") == 0)
+    {
+        // Exactly one whitespace character before the binary data
+        fgetc(file);
+        return fread(&img.pixels[0], 1, img.pixels.size(), file) == img.pixels.size();
+    }
+    if (strcmp(magic, "P3") != 0)
+        return false;
+    for (unsigned i = 0; i < img.pixels.size(); i++)
+    {
+        unsigned v;
+        if (fscanf(file, "%u", &v) != 1)
+            return false;
+        img.pixels[i] = v;
+    }
+    return true;
+}
+
+// Returns the number after "key": in the JSON object json, or 0
+double json_number(const std::string &json, const std::string &key)
+{
+    size_t pos = json.find("\"" + key + "\":");
+    if (pos == std::string::npos)
+        return 0;
+    return strtod(json.c_str() + pos + key.size() + 3, NULL);
+}
+
+// Returns the median of times, which is reordered
+double median(std::vector<double> &times)
+{
+    std::sort(times.begin(), times.end());
+    size_t n = times.size();
+    return n % 2 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+}
+
+/**
+ * Renders scene in shading mode mode at res x res, runs times, and keeps the
+ * median wall and render times, which one slow or lucky run doesn't move.
+ * Returns false if shaded failed.
+ */
+bool render(const char *scene, int mode, int res, int runs, result &out)
+{
+    char statsFile[] = "/tmp/benchmarkXXXXXX";
+    int fd = mkstemp(statsFile);
+    if (fd == -1)
+        return false;
+    close(fd);
+
+    std::ostringstream command;
+    // One thread, so the times are steadier
+    command << "./shaded " << mode << ' ' << res << ' ' << res << " -threads 1 -stats " << statsFile
+        << " < hw3_data/" << scene << ".iv 2> /dev/null";
+
+    bool ok = true;
+    std::vector<double> walls, renders;
+    for (int run = 0; run < runs && ok; run++)
+    {
+        double start = statsClock();
+        FILE *pipe = popen(command.str().c_str(), "r");
+        image img;
+        ok = pipe && read_ppm(pipe, img);
+        ok = pipe && pclose(pipe) == 0 && ok;
+        double wall = statsClock() - start;
+        if (!ok)
+            break;
+
+        std::ifstream file(statsFile);
+        std::string json((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        double renderTime = json_number(json, "transform") + json_number(json, "raster") +
+            json_number(json, "deferredShading");
+
+        walls.push_back(wall);
+        renders.push_back(renderTime);
+        out.img = img;
+    }
+    unlink(statsFile);
+    if (ok)
+    {
+        out.wall = median(walls);
+        out.render = median(renders);
+    }
+    return ok;
+}
+
+/**
+ * Counts the pixels of a and b with some channel more than tolerance apart.
+ * Images of different sizes differ everywhere.
+ */
+int count_mismatches(const image &a, const image &b, int tolerance)
+{
+    if (a.xres != b.xres || a.yres != b.yres)
+        return a.xres * a.yres;
+
+    int count = 0;
+    for (unsigned i = 0; i < a.pixels.size(); i += 3)
+        for (int c = 0; c < 3; c++)
+            if (abs(a.pixels[i + c] - b.pixels[i + c]) > tolerance)
+            {
+                count++;
+                break;
+            }
+    return count;
+}
+
+std::string reference_path(const char *scene, int mode, int res)
+{
+    std::ostringstream path;
+    path << REFERENCE_DIR << '/' << scene << '-' << mode << '-' << res << ".ppm.gz";
+    return path.str();
+}
+
+std::string timing_key(const char *scene, int mode, int res)
+{
+    std::ostringstream key;
+    key << scene << ' ' << mode << ' ' << res;
+    return key.str();
+}
+
+/**
+ * Renders every scene in every mode and resolution.  Each image is compared
+ * against its reference in bench/ and each render time against
+ * bench/timings.  An image fails if more than mismatch of its pixels have a
+ * channel more than tolerance off, and the run fails if the total render time
+ * of everything is more than slowdown times the recorded total, and more
+ * than TOTAL_SLACK over it.  Exits with 1 if anything failed.
+ *
+ * -update records new reference images and timings instead, -retime only new
+ * timings, for a different machine.
+ */
+int main(int argc, char **argv)
+{
+    bool update = false;
+    bool retime = false;
+    int runs = 5;
+    int tolerance = 2;
+    double mismatch = 0.001;
+    double slowdown = 1.25;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-update") == 0)
+            update = true;
+        else if (strcmp(argv[i], "-retime") == 0)
+            retime = true;
+        else if (strcmp(argv[i], "-runs") == 0 && i + 1 < argc)
+            runs = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "-tolerance") == 0 && i + 1 < argc)
+            tolerance = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-mismatch") == 0 && i + 1 < argc)
+            mismatch = atof(argv[++i]);
+        else if (strcmp(argv[i], "-slowdown") == 0 && i + 1 < argc)
+            slowdown = atof(argv[++i]);
+        else
+            usage();
+    }
+
+    // Recorded render times, by timing_key
+    std::map<std::string, double> timings;
+    std::ifstream timingsIn(TIMINGS_FILE);
+    std::string line;
+    while (std::getline(timingsIn, line))
+    {
+        size_t split = line.rfind(' ');
+        if (split != std::string::npos)
+            timings[line.substr(0, split)] = atof(line.c_str() + split + 1);
+    }
+    timingsIn.close();
+
+    int failures = 0;
+    double totalWall = 0, totalRender = 0;
+    // Recorded total for what was rendered, 0 if anything wasn't recorded
+    double totalBefore = 0;
+    bool allRecorded = true;
+    for (int s = 0; s < NUM_SCENES; s++)
+    {
+        for (int mode = 0; mode < NUM_MODES; mode++)
+        {
+            for (int r = 0; r < NUM_RESOLUTIONS; r++)
+            {
+                const char *scene = SCENES[s];
+                int res = RESOLUTIONS[r];
+                std::string key = timing_key(scene, mode, res);
+                std::string refPath = reference_path(scene, mode, res);
+
+                result out;
+                if (!render(scene, mode, res, runs, out))
+                {
+                    std::cout << key << "  shaded failed\n";
+                    failures++;
+                    continue;
+                }
+                totalWall += out.wall;
+                totalRender += out.render;
+
+                char summary[128];
+                snprintf(summary, sizeof(summary), "%-16s %8.4f s wall %8.4f s render %8.2f Mpixel/s",
+                        key.c_str(), out.wall, out.render,
+                        out.render > 0 ? res * res / out.render / 1e6 : 0.0);
+                std::cout << summary;
+
+                if (update)
+                {
+                    std::string command = "gzip -9 > " + refPath;
+                    FILE *pipe = popen(command.c_str(), "w");
+                    if (pipe)
+                    {
+                        fprintf(pipe, "P6\n%d %d\n255\n", out.img.xres, out.img.yres);
+                        fwrite(&out.img.pixels[0], 1, out.img.pixels.size(), pipe);
+                    }
+                    if (!pipe || pclose(pipe) != 0)
+                    {
+                        std::cerr << "Unable to write " << refPath << '\n';
+                        exit(1);
+                    }
+                }
+                if (update || retime)
+                {
+                    timings[key] = out.render;
+                    std::cout << "  recorded\n";
+                    continue;
+                }
+
+                bool ok = true;
+                image reference;
+                std::string command = "gzip -dc " + refPath + " 2> /dev/null";
+                FILE *pipe = popen(command.c_str(), "r");
+                bool haveReference = pipe && read_ppm(pipe, reference);
+                if (pipe)
+                    pclose(pipe);
+                if (!haveReference)
+                {
+                    std::cout << "  no reference image";
+                    ok = false;
+                }
+                else
+                {
+                    int bad = count_mismatches(out.img, reference, tolerance);
+                    if (bad > mismatch * res * res)
+                    {
+                        std::cout << "  IMAGE MISMATCH (" << bad << " pixels)";
+                        ok = false;
+                    }
+                }
+
+                if (timings.count(key))
+                {
+                    double before = timings[key];
+                    totalBefore += before;
+                    if (out.render > before * NOTE_SLOWDOWN && out.render - before > NOTE_SLACK)
+                        std::cout << "  slower (was " << before << " s)";
+                }
+                else
+                    allRecorded = false;
+
+                std::cout << (ok ? "  ok\n" : "\n");
+                if (!ok)
+                    failures++;
+            }
+        }
+    }
+
+    if (update || retime)
+    {
+        std::ofstream timingsOut(TIMINGS_FILE);
+        for (std::map<std::string, double>::const_iterator it = timings.begin(); it != timings.end(); it++)
+            timingsOut << it->first << ' ' << it->second << '\n';
+        if (!timingsOut)
+        {
+            std::cerr << "Unable to write " << TIMINGS_FILE << '\n';
+            exit(1);
+        }
+    }
+
+    std::cout << "total " << totalWall << " s wall, " << totalRender << " s render";
+    if (!update && !retime)
+    {
+        if (!allRecorded)
+            std::cout << ", no recorded time for some";
+        else if (totalRender > totalBefore * slowdown && totalRender - totalBefore > TOTAL_SLACK)
+        {
+            std::cout << ", SLOWER than " << totalBefore << " s";
+            failures++;
+        }
+        else
+            std::cout << ", was " << totalBefore << " s";
+    }
+    if (failures)
+        std::cout << ", " << failures << " FAILED";
+    std::cout << '\n';
+    return failures ? 1 : 0;
+}
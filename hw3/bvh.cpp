@@ -0,0 +1,319 @@
+#include <algorithm>
+#include <limits>
+#include "bvh.h"
+
+// Centroids are sorted into this many bins along each axis to look for the
+// cheapest split
+static const int BVH_BINS = 16;
+
+// Leaves with no more triangles than this are never split, one packet's
+// worth.  Ones with more than BVH_MAX_LEAF always are, if they can be.
+static const int BVH_LEAF_TRIANGLES = 4;
+static const int BVH_MAX_LEAF = 16;
+
+// Nodes this deep become leaves however big, which bounds the traversal stack
+static const int BVH_MAX_DEPTH = 48;
+
+// Surface area heuristic costs of testing a ray against a node's four boxes,
+// relative to testing it against one packet of four triangles
+static const float BVH_NODE_COST = 1;
+
+// A triangle's bounds while building
+struct bvh::buildRef
+{
+    float min[3], max[3];
+    float center[3];
+    int triangle;
+};
+
+// An axis aligned box that starts out empty
+struct buildBox
+{
+    float min[3], max[3];
+
+    buildBox()
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            min[i] = std::numeric_limits<float>::max();
+            max[i] = -std::numeric_limits<float>::max();
+        }
+    }
+
+    void grow(const float lo[3], const float hi[3])
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            min[i] = std::min(min[i], lo[i]);
+            max[i] = std::max(max[i], hi[i]);
+        }
+    }
+
+    // Half the surface area, which is all the heuristic needs
+    float area() const
+    {
+        float dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+        if (dx < 0)
+            return 0;
+        return dx * dy + dy * dz + dz * dx;
+    }
+};
+
+// Packets needed for n triangles
+static int packets(int n)
+{
+    return (n + 3) / 4;
+}
+
+void bvh::build(const std::vector<Vector3> &points, const std::vector<int> &triangles)
+{
+    nodes_.clear();
+    packets_.clear();
+    root_.child = -1;
+    root_.count = 0;
+
+    std::vector<buildRef> refs(triangles.size() / 3);
+    for (unsigned t = 0; t < refs.size(); t++)
+    {
+        buildRef &ref = refs[t];
+        ref.triangle = t;
+        for (int i = 0; i < 3; i++)
+        {
+            ref.min[i] = ref.max[i] = points[triangles[3*t]](i);
+            for (int c = 1; c < 3; c++)
+            {
+                ref.min[i] = std::min(ref.min[i], points[triangles[3*t + c]](i));
+                ref.max[i] = std::max(ref.max[i], points[triangles[3*t + c]](i));
+            }
+            ref.center[i] = (ref.min[i] + ref.max[i]) / 2;
+        }
+    }
+    if (refs.empty())
+        return;
+
+    root_ = buildChild(refs, 0, refs.size(), 0, false);
+
+    // Fill in the packets' vertices, in the order the leaves put them
+    for (unsigned p = 0; p < packets_.size(); p++)
+    {
+        packet &tris = packets_[p];
+        float v0[3][4], e1[3][4], e2[3][4];
+        for (int lane = 0; lane < 4; lane++)
+        {
+            int t = tris.triangle[lane];
+            for (int i = 0; i < 3; i++)
+            {
+                if (t < 0)
+                {
+                    v0[i][lane] = e1[i][lane] = e2[i][lane] = 0;
+                    continue;
+                }
+                float a = points[triangles[3*t]](i);
+                v0[i][lane] = a;
+                e1[i][lane] = points[triangles[3*t + 1]](i) - a;
+                e2[i][lane] = points[triangles[3*t + 2]](i) - a;
+            }
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            tris.v0[i] = _mm_loadu_ps(v0[i]);
+            tris.e1[i] = _mm_loadu_ps(e1[i]);
+            tris.e2[i] = _mm_loadu_ps(e2[i]);
+        }
+    }
+}
+
+/**
+ * Builds refs [begin, end) as one child of a node: a leaf of packets if leaf
+ * is set or it's too small or deep to split, and a node otherwise.
+ */
+bvh::stackEntry bvh::buildChild(std::vector<buildRef> &refs, int begin, int end, int depth, bool leaf)
+{
+    stackEntry entry;
+    if (leaf || end - begin <= BVH_LEAF_TRIANGLES || depth >= BVH_MAX_DEPTH)
+    {
+        entry.child = packets_.size();
+        entry.count = packets(end - begin);
+        for (int i = begin; i < end; i += 4)
+            addPacket(refs, i, std::min(i + 4, end));
+        return entry;
+    }
+    entry.child = buildNode(refs, begin, end, depth);
+    entry.count = 0;
+    return entry;
+}
+
+/**
+ * Builds a node over refs [begin, end) and everything under it, and returns
+ * its index.  The range is split in two, and then the biggest part split
+ * again, until there are four children or nothing is worth splitting.
+ */
+int bvh::buildNode(std::vector<buildRef> &refs, int begin, int end, int depth)
+{
+    int index = nodes_.size();
+    nodes_.push_back(node());
+
+    int first[4], last[4];
+    bool leaf[4] = {false, false, false, false};
+    int numChildren = 1;
+    first[0] = begin;
+    last[0] = end;
+    while (numChildren < 4)
+    {
+        int biggest = -1;
+        for (int i = 0; i < numChildren; i++)
+            if (!leaf[i] && (biggest < 0 || last[i] - first[i] > last[biggest] - first[biggest]))
+                biggest = i;
+        if (biggest < 0)
+            break;
+
+        int middle;
+        if (!split(refs, first[biggest], last[biggest], middle))
+        {
+            leaf[biggest] = true;
+            continue;
+        }
+        first[numChildren] = middle;
+        last[numChildren] = last[biggest];
+        last[biggest] = middle;
+        numChildren++;
+    }
+
+    float lo[3][4], hi[3][4];
+    int child[4], count[4];
+    for (int i = 0; i < 4; i++)
+    {
+        buildBox box;
+        if (i < numChildren)
+        {
+            for (int r = first[i]; r < last[i]; r++)
+                box.grow(refs[r].min, refs[r].max);
+            // The node vector may move while children are built
+            stackEntry entry = buildChild(refs, first[i], last[i], depth + 1, leaf[i]);
+            child[i] = entry.child;
+            count[i] = entry.count;
+        }
+        else
+        {
+            child[i] = -1;
+            count[i] = 0;
+        }
+        for (int a = 0; a < 3; a++)
+        {
+            lo[a][i] = box.min[a];
+            hi[a][i] = box.max[a];
+        }
+    }
+
+    node &n = nodes_[index];
+    n.minX = _mm_loadu_ps(lo[0]);
+    n.minY = _mm_loadu_ps(lo[1]);
+    n.minZ = _mm_loadu_ps(lo[2]);
+    n.maxX = _mm_loadu_ps(hi[0]);
+    n.maxY = _mm_loadu_ps(hi[1]);
+    n.maxZ = _mm_loadu_ps(hi[2]);
+    std::copy(child, child + 4, n.child);
+    std::copy(count, count + 4, n.count);
+    return index;
+}
+
+/**
+ * Finds the cheapest split of refs [begin, end) by the surface area
+ * heuristic, binning triangles by their centers, and partitions them so
+ * [begin, middle) goes left.  Returns false if a leaf would be cheaper.
+ */
+bool bvh::split(std::vector<buildRef> &refs, int begin, int end, int &middle) const
+{
+    int n = end - begin;
+    if (n <= BVH_LEAF_TRIANGLES)
+        return false;
+
+    buildBox bounds, centers;
+    for (int r = begin; r < end; r++)
+    {
+        bounds.grow(refs[r].min, refs[r].max);
+        centers.grow(refs[r].center, refs[r].center);
+    }
+
+    float bestCost = std::numeric_limits<float>::max();
+    int bestAxis = -1, bestBin = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float extent = centers.max[axis] - centers.min[axis];
+        if (extent <= 0)
+            continue;
+        float scale = BVH_BINS / extent;
+
+        buildBox boxes[BVH_BINS];
+        int counts[BVH_BINS] = {0};
+        for (int r = begin; r < end; r++)
+        {
+            int bin = std::min(BVH_BINS - 1, static_cast<int>((refs[r].center[axis] - centers.min[axis]) * scale));
+            boxes[bin].grow(refs[r].min, refs[r].max);
+            counts[bin]++;
+        }
+
+        // Areas and counts of everything right of each split, then sweep
+        // from the left
+        float rightArea[BVH_BINS];
+        int rightCount[BVH_BINS];
+        buildBox right;
+        int count = 0;
+        for (int b = BVH_BINS - 1; b > 0; b--)
+        {
+            right.grow(boxes[b].min, boxes[b].max);
+            count += counts[b];
+            rightArea[b] = right.area();
+            rightCount[b] = count;
+        }
+        buildBox left;
+        count = 0;
+        for (int b = 1; b < BVH_BINS; b++)
+        {
+            left.grow(boxes[b - 1].min, boxes[b - 1].max);
+            count += counts[b - 1];
+            if (count == 0 || rightCount[b] == 0)
+                continue;
+            float cost = left.area() * packets(count) + rightArea[b] * packets(rightCount[b]);
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = b;
+            }
+        }
+    }
+
+    float area = bounds.area();
+    if (bestAxis >= 0 && area > 0)
+    {
+        float leafCost = packets(n);
+        float splitCost = BVH_NODE_COST + bestCost / area;
+        if (splitCost >= leafCost && n <= BVH_MAX_LEAF)
+            return false;
+
+        float scale = BVH_BINS / (centers.max[bestAxis] - centers.min[bestAxis]);
+        float lo = centers.min[bestAxis];
+        buildRef *mid = std::partition(&refs[0] + begin, &refs[0] + end, [&](const buildRef &ref)
+        {
+            return std::min(BVH_BINS - 1, static_cast<int>((ref.center[bestAxis] - lo) * scale)) < bestBin;
+        });
+        middle = mid - &refs[0];
+        return true;
+    }
+
+    // Every center is in the same place, so only halving is left
+    if (n <= BVH_MAX_LEAF)
+        return false;
+    middle = begin + n / 2;
+    return true;
+}
+
+// Appends a packet of refs [begin, end), at most four
+void bvh::addPacket(const std::vector<buildRef> &refs, int begin, int end)
+{
+    packet tris;
+    for (int lane = 0; lane < 4; lane++)
+        tris.triangle[lane] = begin + lane < end ? refs[begin + lane].triangle : -1;
+    packets_.push_back(tris);
+}
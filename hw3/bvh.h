@@ -0,0 +1,220 @@
+#pragma once
+#include <vector>
+#include <xmmintrin.h>
+#include "matrix.h"
+
+/*
+ * A bounding volume hierarchy over triangles, for tracing rays through a
+ * scene.  Nodes have four children whose boxes are stored structure of arrays
+ * style, so a ray is tested against all four boxes with a handful of SSE
+ * instructions; leaves hold triangles in packets of four the same way.  The
+ * tree is built with the surface area heuristic (bvh.cpp).
+ */
+
+// Where a ray hit a triangle
+struct rayHit
+{
+    // Distance along the ray, in units of its direction
+    float t;
+    // Barycentric weights of the triangle's second and third vertices
+    float u, v;
+    // Index of the triangle, as given to build
+    int triangle;
+};
+
+class bvh
+{
+public:
+    // Builds the hierarchy over triangles, three indices into points each
+    void build(const std::vector<Vector3> &points, const std::vector<int> &triangles);
+
+    // Finds the nearest front facing triangle that origin + t * dir hits for
+    // some t in (0, tMax).  Triangles are front facing when their vertices
+    // go counterclockwise seen from the ray, as when rasterizing.
+    bool intersect(const float origin[3], const float dir[3], float tMax, rayHit &hit) const
+    {
+        return traverse<false>(origin, dir, tMax, hit);
+    }
+
+    // Returns true if origin + t * dir hits any triangle, facing either way,
+    // for some t in (0, tMax)
+    bool occluded(const float origin[3], const float dir[3], float tMax) const
+    {
+        rayHit hit;
+        return traverse<true>(origin, dir, tMax, hit);
+    }
+
+private:
+    // Child i's box is lane i of the bounds.  Children with a count of 0 are
+    // nodes, others are leaves of count packets starting at child, and
+    // unused children are -1.
+    struct node
+    {
+        __m128 minX, minY, minZ;
+        __m128 maxX, maxY, maxZ;
+        int child[4];
+        int count[4];
+    };
+
+    // Four triangles as a first vertex and two edges from it.  Unused lanes
+    // are all zero, which no ray hits, with a triangle of -1.
+    struct packet
+    {
+        __m128 v0[3];
+        __m128 e1[3];
+        __m128 e2[3];
+        int triangle[4];
+    };
+
+    // A node, or leaf, waiting to be visited
+    struct stackEntry
+    {
+        int child;
+        int count;
+    };
+
+    // Deep enough for any tree build makes, see BVH_MAX_DEPTH
+    static const int STACK_SIZE = 256;
+
+    std::vector<node> nodes_;
+    std::vector<packet> packets_;
+    // The root, like a child of a node
+    stackEntry root_;
+
+    struct buildRef;
+    stackEntry buildChild(std::vector<buildRef> &refs, int begin, int end, int depth, bool leaf);
+    int buildNode(std::vector<buildRef> &refs, int begin, int end, int depth);
+    bool split(std::vector<buildRef> &refs, int begin, int end, int &middle) const;
+    void addPacket(const std::vector<buildRef> &refs, int begin, int end);
+
+    static __m128 cross(const __m128 a[3], const __m128 b[3], int i)
+    {
+        int j = (i + 1) % 3, k = (i + 2) % 3;
+        return _mm_sub_ps(_mm_mul_ps(a[j], b[k]), _mm_mul_ps(a[k], b[j]));
+    }
+
+    static __m128 dot(const __m128 a[3], const __m128 b[3])
+    {
+        return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])),
+                _mm_mul_ps(a[2], b[2]));
+    }
+
+    // With ANY, stops at the first triangle hit facing either way, otherwise
+    // finds the nearest front facing one
+    template<bool ANY>
+    bool traverse(const float origin[3], const float dir[3], float tMax, rayHit &hit) const
+    {
+        if (root_.child < 0)
+            return false;
+
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1);
+        __m128 o[3], d[3], inv[3];
+        for (int i = 0; i < 3; i++)
+        {
+            o[i] = _mm_set1_ps(origin[i]);
+            d[i] = _mm_set1_ps(dir[i]);
+            inv[i] = _mm_set1_ps(1 / dir[i]);
+        }
+
+        bool found = false;
+        float best = tMax;
+        stackEntry stack[STACK_SIZE];
+        int top = 0;
+        stack[top++] = root_;
+        while (top > 0)
+        {
+            stackEntry entry = stack[--top];
+            if (entry.count == 0)
+            {
+                // Slab test against all four children
+                const node &n = nodes_[entry.child];
+                __m128 t0 = _mm_mul_ps(_mm_sub_ps(n.minX, o[0]), inv[0]);
+                __m128 t1 = _mm_mul_ps(_mm_sub_ps(n.maxX, o[0]), inv[0]);
+                __m128 tNear = _mm_min_ps(t0, t1), tFar = _mm_max_ps(t0, t1);
+                t0 = _mm_mul_ps(_mm_sub_ps(n.minY, o[1]), inv[1]);
+                t1 = _mm_mul_ps(_mm_sub_ps(n.maxY, o[1]), inv[1]);
+                tNear = _mm_max_ps(tNear, _mm_min_ps(t0, t1));
+                tFar = _mm_min_ps(tFar, _mm_max_ps(t0, t1));
+                t0 = _mm_mul_ps(_mm_sub_ps(n.minZ, o[2]), inv[2]);
+                t1 = _mm_mul_ps(_mm_sub_ps(n.maxZ, o[2]), inv[2]);
+                tNear = _mm_max_ps(_mm_max_ps(tNear, _mm_min_ps(t0, t1)), zero);
+                tFar = _mm_min_ps(_mm_min_ps(tFar, _mm_max_ps(t0, t1)), _mm_set1_ps(best));
+                int mask = _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+
+                // Push the children hit, farthest first so the nearest is
+                // visited next
+                float nears[4];
+                _mm_storeu_ps(nears, tNear);
+                int order[4], numHit = 0;
+                for (int i = 0; i < 4; i++)
+                {
+                    if (!(mask & (1 << i)) || n.child[i] < 0)
+                        continue;
+                    int j = numHit++;
+                    for (; j > 0 && nears[order[j - 1]] < nears[i]; j--)
+                        order[j] = order[j - 1];
+                    order[j] = i;
+                }
+                for (int j = 0; j < numHit; j++)
+                {
+                    stack[top].child = n.child[order[j]];
+                    stack[top].count = n.count[order[j]];
+                    top++;
+                }
+                continue;
+            }
+
+            // Moller-Trumbore against four triangles at a time
+            for (int p = entry.child; p < entry.child + entry.count; p++)
+            {
+                const packet &tris = packets_[p];
+                __m128 pvec[3] = {cross(d, tris.e2, 0), cross(d, tris.e2, 1), cross(d, tris.e2, 2)};
+                __m128 det = dot(tris.e1, pvec);
+                // Front faces have a positive determinant, and zero is edge
+                // on or an unused lane
+                __m128 valid = ANY ? _mm_cmpneq_ps(det, zero) : _mm_cmpgt_ps(det, zero);
+                if (!_mm_movemask_ps(valid))
+                    continue;
+                __m128 invDet = _mm_div_ps(one, det);
+
+                __m128 tvec[3];
+                for (int i = 0; i < 3; i++)
+                    tvec[i] = _mm_sub_ps(o[i], tris.v0[i]);
+                __m128 u = _mm_mul_ps(dot(tvec, pvec), invDet);
+                __m128 qvec[3] = {cross(tvec, tris.e1, 0), cross(tvec, tris.e1, 1), cross(tvec, tris.e1, 2)};
+                __m128 v = _mm_mul_ps(dot(d, qvec), invDet);
+                __m128 t = _mm_mul_ps(dot(tris.e2, qvec), invDet);
+
+                valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+                valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+                valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), one));
+                valid = _mm_and_ps(valid, _mm_cmpgt_ps(t, zero));
+                valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_set1_ps(best)));
+                int mask = _mm_movemask_ps(valid);
+                if (!mask)
+                    continue;
+                if (ANY)
+                    return true;
+
+                float ts[4], us[4], vs[4];
+                _mm_storeu_ps(ts, t);
+                _mm_storeu_ps(us, u);
+                _mm_storeu_ps(vs, v);
+                for (int i = 0; i < 4; i++)
+                {
+                    if ((mask & (1 << i)) && ts[i] < best)
+                    {
+                        best = ts[i];
+                        hit.t = ts[i];
+                        hit.u = us[i];
+                        hit.v = vs[i];
+                        hit.triangle = tris.triangle[i];
+                        found = true;
+                    }
+                }
+            }
+        }
+        return found;
+    }
+};
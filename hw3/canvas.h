@@ -1,9 +1,22 @@
 #pragma once
 #include <ostream>
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 #include <cmath>
 
+// Width and height in pixels of the square tiles the canvas is split into
+static const unsigned TILE_SIZE = 8;
+
+// Storage formats for the z buffer.  The fixed point formats map NDC z in
+// [-1, 1] onto [0, 2^bits - 1].
+enum DepthFormat
+{
+    DEPTH_FLOAT,
+    DEPTH_16,
+    DEPTH_24
+};
+
 class Canvas
 {
 public:
@@ -11,28 +24,46 @@ public:
     Canvas() :
         r_(NULL),
         g_(NULL),
-        b_(NULL)
+        b_(NULL),
+        z_(NULL),
+        zfixed_(NULL),
+        tileCleared_(NULL),
+        tileZMin_(NULL),
+        tileZMax_(NULL),
+        tileZMaxCount_(NULL)
     {}
 
-    Canvas(float xmin, float xmax, float ymin, float ymax, unsigned xres, unsigned yres) :
+    Canvas(float xmin, float xmax, float ymin, float ymax, unsigned xres, unsigned yres,
+            DepthFormat depthFormat = DEPTH_FLOAT) :
         xmin_(xmin),
         xmax_(xmax),
         ymin_(ymin),
         ymax_(ymax),
         xres_(xres),
-        yres_(yres)
+        yres_(yres),
+        xtiles_((xres + TILE_SIZE - 1) / TILE_SIZE),
+        ytiles_((yres + TILE_SIZE - 1) / TILE_SIZE),
+        depthFormat_(depthFormat),
+        z_(NULL),
+        zfixed_(NULL),
+        clearR_(0.0f),
+        clearG_(0.0f),
+        clearB_(0.0f)
     {
         r_ = new float[xres * yres];
         b_ = new float[xres * yres];
         g_ = new float[xres * yres];
-        z_ = new float[xres * yres];
+        if (depthFormat_ == DEPTH_FLOAT)
+            z_ = new float[xres * yres];
+        else
+            zfixed_ = new unsigned char[xres * yres * depthBytes()];
+        tileCleared_ = new bool[xtiles_ * ytiles_];
+        tileZMin_ = new float[xtiles_ * ytiles_];
+        tileZMax_ = new float[xtiles_ * ytiles_];
+        tileZMaxCount_ = new unsigned[xtiles_ * ytiles_];
 
         // Initialize to black, and infinite z
-        for (unsigned i = 0; i < xres * yres; i++)
-        {
-            r_[i] = b_[i] = g_[i] = 0.0f;
-            z_[i] = HUGE_VAL;
-        }
+        clear();
     }
 
     ~Canvas()
@@ -41,6 +72,32 @@ public:
         delete[] g_;
         delete[] b_;
         delete[] z_;
+        delete[] zfixed_;
+        delete[] tileCleared_;
+        delete[] tileZMin_;
+        delete[] tileZMax_;
+        delete[] tileZMaxCount_;
+    }
+
+    // Sets the color that cleared pixels take
+    void setClearColor(float r, float g, float b)
+    {
+        colorClamp(r, g, b);
+        clearR_ = r;
+        clearG_ = g;
+        clearB_ = b;
+    }
+
+    // Clears the canvas to the clear color and infinite z.  Pixels are not
+    // touched here, only the tiles are marked; a tile is actually filled in
+    // the first time it is drawn to.
+    void clear()
+    {
+        for (unsigned i = 0; i < xtiles_ * ytiles_; i++)
+        {
+            tileCleared_[i] = true;
+            tileZMin_[i] = tileZMax_[i] = clearDepth();
+        }
     }
 
     int getPixelX(float n) const
@@ -63,6 +120,18 @@ public:
         return yres_;
     }
 
+    DepthFormat getDepthFormat() const
+    {
+        return depthFormat_;
+    }
+
+    // Returns true if every pixel of tile (tx, ty) is nearer than zmin, that
+    // is, nothing with depth zmin or farther can be drawn in that tile.
+    bool tileOccludes(unsigned tx, unsigned ty, float zmin) const
+    {
+        return depthKey(zmin) > tileZMax_[ty * xtiles_ + tx];
+    }
+
     void drawPixel(unsigned x, unsigned y, float r, float g, float b)
     {
         if (x < 0 || x >= xres_ || y < 0 || y >= yres_)
@@ -73,6 +142,8 @@ public:
 
         //std::cout << "Drawing pixel: (" << x << ',' << y << ")\n";
 
+        touchTile(x, y);
+
         int i = y * xres_ + x;
         r_[i] = r;
         g_[i] = g;
@@ -86,8 +157,11 @@ public:
             return;
 
         int i = y * xres_ + x;
-        // Depth test
-        if (z > z_[i])
+        float key = depthKey(z);
+        // Depth test, a cleared tile is infinitely far away so there's no
+        // need to read the z buffer
+        float old = clearDepth();
+        if (!touchTile(x, y) && key > (old = readDepth(i)))
             return;
 
         // Clamp the colors
@@ -96,7 +170,35 @@ public:
         r_[i] = r;
         g_[i] = g;
         b_[i] = b;
-        z_[i] = z;
+        writeDepth(i, key);
+        updateTileDepth(x, y, old, key);
+    }
+
+    // Writes only the z buffer, respecting the depth test
+    void drawDepth(unsigned x, unsigned y, float z)
+    {
+        if (x < 0 || x >= xres_ || y < 0 || y >= yres_ || z < -1)
+            return;
+
+        int i = y * xres_ + x;
+        float key = depthKey(z);
+        float old = clearDepth();
+        if (!touchTile(x, y) && key > (old = readDepth(i)))
+            return;
+
+        writeDepth(i, key);
+        updateTileDepth(x, y, old, key);
+    }
+
+    // Returns true if drawPixel would draw a fragment at depth z at pixel
+    // (x, y).  Doesn't touch the canvas.
+    bool depthPasses(unsigned x, unsigned y, float z) const
+    {
+        if (x < 0 || x >= xres_ || y < 0 || y >= yres_ || z < -1)
+            return false;
+        if (tileCleared_[(y / TILE_SIZE) * xtiles_ + x / TILE_SIZE])
+            return true;
+        return !(depthKey(z) > readDepth(y * xres_ + x));
     }
 
 
@@ -200,6 +302,19 @@ public:
 
     }
 
+    // Returns how many pixels have been drawn to since the last clear, that
+    // is, have a depth nearer than infinity
+    unsigned long long coveredPixels() const
+    {
+        unsigned long long count = 0;
+        for (unsigned y = 0; y < yres_; y++)
+            for (unsigned x = 0; x < xres_; x++)
+                if (!tileCleared_[(y / TILE_SIZE) * xtiles_ + x / TILE_SIZE] &&
+                        readDepth(y * xres_ + x) != clearDepth())
+                    count++;
+        return count;
+    }
+
     void display(std::ostream &os, unsigned maxintensity) const
     {
         // Output PPM header
@@ -207,12 +322,17 @@ public:
         os << xres_ << ' ' << yres_ << '\n';
         os << maxintensity << '\n';
 
-        // Now the pixel data
-        for (unsigned i = 0; i < xres_ * yres_; i++)
+        // Now the pixel data, untouched tiles are still the clear color
+        for (unsigned y = 0; y < yres_; y++)
         {
-            os << static_cast<unsigned>(r_[i] * maxintensity) << ' ';
-            os << static_cast<unsigned>(g_[i] * maxintensity) << ' ';
-            os << static_cast<unsigned>(b_[i] * maxintensity) << '\n';
+            for (unsigned x = 0; x < xres_; x++)
+            {
+                unsigned i = y * xres_ + x;
+                bool cleared = tileCleared_[(y / TILE_SIZE) * xtiles_ + x / TILE_SIZE];
+                os << static_cast<unsigned>((cleared ? clearR_ : r_[i]) * maxintensity) << ' ';
+                os << static_cast<unsigned>((cleared ? clearG_ : g_[i]) * maxintensity) << ' ';
+                os << static_cast<unsigned>((cleared ? clearB_ : b_[i]) * maxintensity) << '\n';
+            }
         }
     }
 
@@ -236,11 +356,151 @@ private:
     float xmin_, xmax_;
     float ymin_, ymax_;
     unsigned xres_, yres_;
+    // Number of tiles in each direction, edge tiles may be partial
+    unsigned xtiles_, ytiles_;
+    DepthFormat depthFormat_;
 
     float *r_;
     float *g_;
     float *b_;
-    // The z buffer
+    // The z buffer, z_ for DEPTH_FLOAT and zfixed_ (packed little endian
+    // integers, depthBytes() per pixel) for the fixed point formats
     float *z_;
+    unsigned char *zfixed_;
+
+    // True for each tile that has been cleared but not yet written to
+    bool *tileCleared_;
+    // Nearest and farthest depth stored in each tile, and how many of the
+    // tile's pixels are at the farthest depth
+    float *tileZMin_;
+    float *tileZMax_;
+    unsigned *tileZMaxCount_;
+    float clearR_, clearG_, clearB_;
+
+    unsigned depthBytes() const
+    {
+        return depthFormat_ == DEPTH_16 ? 2 : 3;
+    }
+
+    // The largest value a fixed point depth can hold
+    unsigned depthMax() const
+    {
+        return depthFormat_ == DEPTH_16 ? 0xFFFF : 0xFFFFFF;
+    }
+
+    // Depths are compared as keys: z itself for DEPTH_FLOAT, and the fixed
+    // point value for the others.  Both fixed point formats fit exactly in a
+    // float.
+    float depthKey(float z) const
+    {
+        if (depthFormat_ == DEPTH_FLOAT)
+            return z;
+
+        float q = floorf((z + 1) * 0.5f * depthMax() + 0.5f);
+        if (q < 0)
+            q = 0;
+        else if (q > depthMax())
+            q = depthMax();
+        return q;
+    }
+
+    // Key of a cleared pixel
+    float clearDepth() const
+    {
+        return depthFormat_ == DEPTH_FLOAT ? HUGE_VAL : depthMax();
+    }
+
+    float readDepth(unsigned i) const
+    {
+        if (depthFormat_ == DEPTH_FLOAT)
+            return z_[i];
+
+        const unsigned char *p = zfixed_ + i * depthBytes();
+        unsigned q = p[0] | (p[1] << 8);
+        if (depthFormat_ == DEPTH_24)
+            q |= p[2] << 16;
+        return q;
+    }
+
+    void writeDepth(unsigned i, float key)
+    {
+        if (depthFormat_ == DEPTH_FLOAT)
+        {
+            z_[i] = key;
+            return;
+        }
+
+        unsigned char *p = zfixed_ + i * depthBytes();
+        unsigned q = static_cast<unsigned>(key);
+        p[0] = q & 0xFF;
+        p[1] = (q >> 8) & 0xFF;
+        if (depthFormat_ == DEPTH_24)
+            p[2] = (q >> 16) & 0xFF;
+    }
+
+    // Keeps the tile depth summaries up to date when a pixel's depth goes
+    // from old to key.  Depth writes only ever move pixels nearer, so the
+    // minimum is exact, and the maximum only needs recomputing when the last
+    // pixel at the farthest depth moves.
+    void updateTileDepth(unsigned x, unsigned y, float old, float key)
+    {
+        unsigned tx = x / TILE_SIZE, ty = y / TILE_SIZE;
+        unsigned t = ty * xtiles_ + tx;
+        if (key < tileZMin_[t])
+            tileZMin_[t] = key;
+        if (old != tileZMax_[t] || key == old || --tileZMaxCount_[t] > 0)
+            return;
+
+        unsigned xend = std::min((tx + 1) * TILE_SIZE, xres_);
+        unsigned yend = std::min((ty + 1) * TILE_SIZE, yres_);
+        float zmax = -HUGE_VAL;
+        unsigned count = 0;
+        for (unsigned py = ty * TILE_SIZE; py < yend; py++)
+        {
+            for (unsigned px = tx * TILE_SIZE; px < xend; px++)
+            {
+                float d = readDepth(py * xres_ + px);
+                if (d > zmax)
+                {
+                    zmax = d;
+                    count = 0;
+                }
+                if (d == zmax)
+                    count++;
+            }
+        }
+        tileZMax_[t] = zmax;
+        tileZMaxCount_[t] = count;
+    }
+
+    // Called before writing pixel (x, y).  If the pixel's tile is still
+    // cleared, fills it with the clear color and infinite z and returns
+    // true.  Otherwise returns false.
+    bool touchTile(unsigned x, unsigned y)
+    {
+        unsigned tx = x / TILE_SIZE, ty = y / TILE_SIZE;
+        unsigned t = ty * xtiles_ + tx;
+        if (!tileCleared_[t])
+            return false;
+
+        unsigned xend = std::min((tx + 1) * TILE_SIZE, xres_);
+        unsigned yend = std::min((ty + 1) * TILE_SIZE, yres_);
+        for (unsigned py = ty * TILE_SIZE; py < yend; py++)
+        {
+            for (unsigned px = tx * TILE_SIZE; px < xend; px++)
+            {
+                unsigned i = py * xres_ + px;
+                r_[i] = clearR_;
+                g_[i] = clearG_;
+                b_[i] = clearB_;
+                writeDepth(i, clearDepth());
+            }
+        }
+        tileCleared_[t] = false;
+        tileZMin_[t] = tileZMax_[t] = clearDepth();
+        tileZMaxCount_[t] = (xend - tx * TILE_SIZE) * (yend - ty * TILE_SIZE);
+
+        return true;
+    }
 };
 
@@ -0,0 +1,67 @@
+#include <fstream>
+#include <iostream>
+#include <cstdlib>
+#include "shaded.h"
+
+void read_scene(std::istream &input, int fd, Scene *output);
+bool write_scene(const Scene &scene, const char *filename);
+void build_mesh(Separator &sep);
+Mesh simplify_mesh(const Mesh &mesh, int targetTriangles);
+
+/**
+ * Simplifies every separator of a scene to a fraction of its triangles
+ * (simplify.cpp) and writes the result as a binary scene file.  The faces
+ * written are the simplified triangles.
+ */
+int main(int argc, char **argv)
+{
+    if (argc != 4)
+    {
+        std::cerr << "usage: decimate in.iv out.scn fraction\n";
+        exit(1);
+    }
+    float fraction = atof(argv[3]);
+    if (fraction <= 0 || fraction > 1)
+    {
+        std::cerr << "The fraction of triangles to keep must be more than 0 and at most 1\n";
+        exit(1);
+    }
+
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in)
+    {
+        std::cerr << "Unable to open " << argv[1] << '\n';
+        exit(1);
+    }
+    Scene scene;
+    read_scene(in, -1, &scene);
+
+    for (unsigned i = 0; i < scene.separators.size(); i++)
+    {
+        Separator &sep = scene.separators[i];
+        build_mesh(sep);
+        int before = sep.mesh.triangles.size() / 3;
+        Mesh simple = simplify_mesh(sep.mesh, before * fraction);
+        std::cout << "separator " << i << ": " << before << " -> " << simple.triangles.size() / 3
+            << " triangles, error " << simple.error << '\n';
+
+        // Triangles become faces, with the same index for point and normal
+        sep.points = simple.points;
+        sep.normals = simple.normals;
+        sep.indices.clear();
+        for (unsigned t = 0; t < simple.triangles.size(); t += 3)
+        {
+            sep.indices.insert(sep.indices.end(), &simple.triangles[t], &simple.triangles[t] + 3);
+            sep.indices.push_back(-1);
+        }
+        sep.normalindices = sep.indices;
+    }
+
+    if (!write_scene(scene, argv[2]))
+    {
+        std::cerr << "Unable to write " << argv[2] << '\n';
+        exit(1);
+    }
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// One worker's share of the work, guarded by its own lock so thieves only
+// contend with its owner
+struct workQueue
+{
+    std::mutex lock;
+    std::deque<unsigned> items;
+};
+
+// Calls func(i) for every i in [0, n) spread over numThreads threads, one of
+// which is the calling thread.  Each thread starts with an interleaved share
+// of the indices and takes from the front of its own queue; when that runs
+// dry it steals from the back of the others'.  Returns once every call has
+// finished.  The threads are started for each call and joined before it
+// returns; nothing is kept running between calls.
+    template<typename Function>
+void parallelFor(unsigned n, unsigned numThreads, Function func)
+{
+    if (numThreads < 1)
+        numThreads = 1;
+
+    std::vector<workQueue> queues(numThreads);
+    for (unsigned i = 0; i < n; i++)
+        queues[i % numThreads].items.push_back(i);
+
+    auto worker = [&](unsigned self)
+    {
+        for (;;)
+        {
+            unsigned item = 0;
+            bool found = false;
+            // Own work first, then everyone else's
+            for (unsigned k = 0; !found && k < numThreads; k++)
+            {
+                workQueue &queue = queues[(self + k) % numThreads];
+                std::lock_guard<std::mutex> guard(queue.lock);
+                if (queue.items.empty())
+                    continue;
+                if (k == 0)
+                {
+                    item = queue.items.front();
+                    queue.items.pop_front();
+                }
+                else
+                {
+                    item = queue.items.back();
+                    queue.items.pop_back();
+                }
+                found = true;
+            }
+            // Nothing creates more work, so once every queue is empty we're
+            // done
+            if (!found)
+                return;
+
+            func(item);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < numThreads; t++)
+        threads.push_back(std::thread(worker, t));
+    worker(0);
+    for (unsigned t = 0; t < threads.size(); t++)
+        threads[t].join();
+}
@@ -1,12 +1,18 @@
 #pragma once
 #include <cassert>
+#include <algorithm>
+#include <emmintrin.h>
 #include "canvas.h"
+#include "stats.h"
 
 static const Canvas *canv;
 
+// The most floats of data a vertex can carry
+static const unsigned MAX_VERTEX_DATA = 16;
+
 struct vertex
 {
-    float *data;
+    float data[MAX_VERTEX_DATA];
     unsigned num_data;
 };
 struct rasterCoord
@@ -14,6 +20,24 @@ struct rasterCoord
     int x, y;
 };
 
+// Everything needed to walk a triangle's pixels, worked out once per triangle
+struct triangleSetup
+{
+    rasterCoord coords[3];
+    // Bounding box clamped to the canvas, the xMax column and yMax row are
+    // not drawn
+    int xStart, yStart, xMax, yMax;
+    // Barycentric coordinates are the edge functions divided by these.  An
+    // exact divide, rather than multiplying by the reciprocal, keeps depths
+    // and colors the same as dividing per pixel always gave.
+    float fAlpha, fBeta, fGamma;
+    // The edge functions are linear, so moving one pixel in x or y changes
+    // each by a constant
+    int alphaDx, alphaDy, betaDx, betaDy, gammaDx, gammaDy;
+    // The nearest depth on the triangle
+    float zMin;
+};
+
 void initRaster(const Canvas *c)
 {
     canv = c;
@@ -28,15 +52,15 @@ static int f(rasterCoord vert0, rasterCoord vert1, int x, int y)
     return (y0 - y1) * x + (x1 - x0) * y + x0 * y1 - x1 * y0;
 }
 
-// The fragment processor template needs to support function call notation
-// with signature void (int, int, float*).  The two int arguments are the
-// pixel coordinates and the float* is arbitrary data.
-    template<typename fragmentProcessor>
-void rasterizeTriangle(vertex verts[3], fragmentProcessor fp)
+// Fills in setup for the triangle.  Returns false if the triangle is
+// degenerate and shouldn't be drawn.
+inline bool setupTriangle(const vertex verts[3], triangleSetup &setup)
 {
     // Make sure the vertices all have the same amount of data
     assert(verts[0].num_data == verts[1].num_data &&
-            verts[0].num_data == verts[1].num_data);
+            verts[0].num_data == verts[2].num_data);
+    assert(verts[0].num_data <= MAX_VERTEX_DATA);
+    rasterCoord *coords = setup.coords;
     // Pixel coordinates for a bounding box
     int xMin, xMax, yMin, yMax;
     // High enough that it doesn't matter
@@ -44,10 +68,7 @@ void rasterizeTriangle(vertex verts[3], fragmentProcessor fp)
     // Low enough that it doesn't matter
     xMax = yMax = -1;
 
-    // Storage space to convert each vertex's x and y to pixel coordinates
-    rasterCoord *coords = new rasterCoord[3];
-
-    // do the conversion
+    // convert each vertex's x and y to pixel coordinates
     for (int i = 0; i < 3; i++)
     {
         coords[i].x = canv->getPixelX(verts[i].data[0]);
@@ -72,9 +93,16 @@ void rasterizeTriangle(vertex verts[3], fragmentProcessor fp)
         xMax = canv->getXRes() - 1;
     if (yMax > canv->getYRes()-1)
         yMax = canv->getYRes() - 1;
+    setup.xStart = (xMin > 0) ? xMin : 0;
+    setup.yStart = (yMin > 0) ? yMin : 0;
+    setup.xMax = xMax;
+    setup.yMax = yMax;
+    // Nothing on screen
+    if (setup.xStart > setup.xMax || setup.yStart > setup.yMax)
+        return false;
 
     // normalizing values for the barycentric coordinates
-    float fAlpha, fBeta, fGamma;
+    float &fAlpha = setup.fAlpha, &fBeta = setup.fBeta, &fGamma = setup.fGamma;
 
     // not sure exactly what's going on here, so read the textbook
     fAlpha = f(coords[1], coords[2], coords[0].x, coords[0].y);
@@ -82,41 +110,334 @@ void rasterizeTriangle(vertex verts[3], fragmentProcessor fp)
     fGamma = f(coords[0], coords[1], coords[2].x, coords[2].y);
 
     // check for zero denominators. if found, these indicate a degenerate
-    // triangle which should not be drawn, so just return.
+    // triangle which should not be drawn.
     if(fabs(fAlpha) < .0001 || fabs(fBeta) < .0001 || fabs(fGamma) < .0001)
+    {
+        if (stats)
+            stats->degenerate++;
+        return false;
+    }
+
+    setup.alphaDx = coords[1].y - coords[2].y; setup.alphaDy = coords[2].x - coords[1].x;
+    setup.betaDx  = coords[2].y - coords[0].y; setup.betaDy  = coords[0].x - coords[2].x;
+    setup.gammaDx = coords[0].y - coords[1].y; setup.gammaDy = coords[1].x - coords[0].x;
+
+    setup.zMin = std::min(verts[0].data[2], std::min(verts[1].data[2], verts[2].data[2]));
+
+    return true;
+}
+
+// Results of classifyBlock
+enum blockCoverage
+{
+    BLOCK_OUTSIDE,
+    BLOCK_PARTIAL,
+    BLOCK_INSIDE
+};
+
+// Classifies the pixels x0 <= x < x1, y0 <= y < y1 against the triangle
+// using the edge functions at the block's corners.  The edge functions are
+// linear, so if every corner is on the outside of one edge the whole block
+// is, and if every corner is inside all three edges the whole block is.
+inline blockCoverage classifyBlock(const triangleSetup &t, int x0, int y0, int x1, int y1)
+{
+    const rasterCoord *coords = t.coords;
+    const int cornerX[4] = {x0, x1 - 1, x0, x1 - 1};
+    const int cornerY[4] = {y0, y0, y1 - 1, y1 - 1};
+    // A pixel is inside an edge when the edge function divided by its
+    // normalizer is >= 0
+    const float normalizers[3] = {t.fAlpha, t.fBeta, t.fGamma};
+    const int ends[3][2] = {{1, 2}, {2, 0}, {0, 1}};
+
+    bool allInside = true;
+    for (int e = 0; e < 3; e++)
+    {
+        int inside = 0;
+        for (int c = 0; c < 4; c++)
+        {
+            int value = f(coords[ends[e][0]], coords[ends[e][1]], cornerX[c], cornerY[c]);
+            if (normalizers[e] > 0 ? value >= 0 : value <= 0)
+                inside++;
+        }
+        if (inside == 0)
+            return BLOCK_OUTSIDE;
+        if (inside < 4)
+            allInside = false;
+    }
+
+    return allInside ? BLOCK_INSIDE : BLOCK_PARTIAL;
+}
+
+// Whether fragments fp sees go in the stats.  Processors that only lay down
+// depth for a later pass specialize this to false, so the pixels aren't
+// counted twice.
+    template<typename fragmentProcessor>
+struct countsFragments
+{
+    static const bool value = true;
+};
+
+// Adds a triangle's fragment counts to the stats
+    template<typename fragmentProcessor>
+inline void addFragments(unsigned long long fragments, unsigned long long rejected)
+{
+    if (stats && countsFragments<fragmentProcessor>::value)
+    {
+        stats->fragments += fragments;
+        stats->depthRejected += rejected;
+        stats->shaded += fragments - rejected;
+    }
+}
+
+// The fragment processor template needs to support function call notation
+// with signature void (int, int, float*).  The two int arguments are the
+// pixel coordinates and the float* is arbitrary data, except that data[2]
+// must be the NDC z coordinate; it is used to skip the tiles the triangle is
+// completely hidden in, and fp is only called for pixels that pass the depth
+// test.
+    template<typename fragmentProcessor>
+void rasterizeTriangle(const vertex verts[3], fragmentProcessor fp)
+{
+    triangleSetup t;
+    if (!setupTriangle(verts, t))
         return;
+    const rasterCoord *coords = t.coords;
 
-    // Create storage- once
     int numData = verts[0].num_data;
-    float *data = new float[numData];
-    // go over every pixel in the bounding box
-    for (int y = (int)((yMin > 0) ? yMin : 0); y < yMax; y++)
+    float data[MAX_VERTEX_DATA];
+    unsigned long long fragments = 0, rejected = 0;
+    // go over every tile in the bounding box
+    for (int ty = t.yStart / TILE_SIZE; ty * (int)TILE_SIZE < t.yMax; ty++)
     {
-        for (int x = (int)((xMin > 0) ? xMin : 0); x < xMax; x++)
+        for (int tx = t.xStart / TILE_SIZE; tx * (int)TILE_SIZE < t.xMax; tx++)
         {
+            // Skip the whole tile if everything in it is nearer than the triangle
+            if (canv->tileOccludes(tx, ty, t.zMin))
+                continue;
+
+            // go over every pixel in the bounding box inside this tile
+            int xTile = std::max(t.xStart, tx * (int)TILE_SIZE);
+            int yTile = std::max(t.yStart, ty * (int)TILE_SIZE);
+            int yEnd = std::min(t.yMax, (ty + 1) * (int)TILE_SIZE);
+            int xEnd = std::min(t.xMax, (tx + 1) * (int)TILE_SIZE);
+            if (xTile >= xEnd || yTile >= yEnd)
+                continue;
 
-            // calculate the pixel's barycentric coordinates
-            float alpha = f(coords[1], coords[2], x, y) / fAlpha;
-            float beta = f(coords[2], coords[0], x, y) / fBeta;
-            float gamma = f(coords[0], coords[1], x, y) / fGamma;
+            // Skip tiles the triangle misses, and don't bother testing pixels
+            // in tiles it covers
+            blockCoverage coverage = classifyBlock(t, xTile, yTile, xEnd, yEnd);
+            if (coverage == BLOCK_OUTSIDE)
+                continue;
+            bool covered = coverage == BLOCK_INSIDE;
 
-            // if the coordinates are positive, do the next check
-            if (alpha >= 0 && beta >= 0 && gamma >= 0)
+            // Edge functions at the start of the current row
+            int alphaRow = f(coords[1], coords[2], xTile, yTile);
+            int betaRow = f(coords[2], coords[0], xTile, yTile);
+            int gammaRow = f(coords[0], coords[1], xTile, yTile);
+            for (int y = yTile; y < yEnd; y++)
             {
-                // interpolate all data
-                for (int i = 0; i < numData; i++)
+                int fa = alphaRow, fb = betaRow, fg = gammaRow;
+                // The triangle is convex, so once a row has been inside and
+                // then leaves it, the rest of the row is outside
+                bool entered = false;
+                for (int x = xTile; x < xEnd; x++, fa += t.alphaDx, fb += t.betaDx, fg += t.gammaDx)
                 {
-                    data[i] = (alpha * verts[0].data[i] +
-                            beta * verts[1].data[i] +
-                            gamma * verts[2].data[i]);
+                    // calculate the pixel's barycentric coordinates
+                    float alpha = fa / t.fAlpha;
+                    float beta = fb / t.fBeta;
+                    float gamma = fg / t.fGamma;
+
+                    // the pixel is only inside if the coordinates are positive
+                    if (!covered && !(alpha >= 0 && beta >= 0 && gamma >= 0))
+                    {
+                        if (entered)
+                            break;
+                        continue;
+                    }
+                    entered = true;
+                    fragments++;
+
+                    // interpolate z first, and don't bother with the rest
+                    // of the data if the pixel is hidden
+                    data[2] = (alpha * verts[0].data[2] +
+                            beta * verts[1].data[2] +
+                            gamma * verts[2].data[2]);
+                    if (!canv->depthPasses(x, y, data[2]))
+                    {
+                        rejected++;
+                        continue;
+                    }
+
+                    // interpolate all data
+                    for (int i = 0; i < numData; i++)
+                    {
+                        if (i == 2)
+                            continue;
+                        data[i] = (alpha * verts[0].data[i] +
+                                beta * verts[1].data[i] +
+                                gamma * verts[2].data[i]);
+                    }
+
+                    // and finally, draw the pixel
+                    fp(x, y, data);
                 }
 
-                // and finally, draw the pixel
-                fp(x, y, data);
+                alphaRow += t.alphaDy;
+                betaRow += t.betaDy;
+                gammaRow += t.gammaDy;
             }
         }
     }
-    // Clean up
-    delete[] data;
-    delete[] coords;
+    addFragments<fragmentProcessor>(fragments, rejected);
+}
+
+// Rasterizes an already set up triangle in 2x2 pixel quads with SSE, only
+// drawing pixels with x0 <= x < x1 and y0 <= y < y1.  See
+// rasterizeTriangleQuads for the fragment processor.
+    template<typename quadFragmentProcessor>
+void rasterizeQuads(const vertex verts[3], const triangleSetup &setup, quadFragmentProcessor fp,
+        int x0, int y0, int x1, int y1)
+{
+    triangleSetup t = setup;
+    t.xStart = std::max(t.xStart, x0);
+    t.yStart = std::max(t.yStart, y0);
+    t.xMax = std::min(t.xMax, x1);
+    t.yMax = std::min(t.yMax, y1);
+    const rasterCoord *coords = t.coords;
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 fAlpha = _mm_set1_ps(t.fAlpha);
+    const __m128 fBeta = _mm_set1_ps(t.fBeta);
+    const __m128 fGamma = _mm_set1_ps(t.fGamma);
+    // Edge function offsets of each pixel in a quad from its top left pixel
+    const __m128i alphaQuad = _mm_setr_epi32(0, t.alphaDx, t.alphaDy, t.alphaDx + t.alphaDy);
+    const __m128i betaQuad = _mm_setr_epi32(0, t.betaDx, t.betaDy, t.betaDx + t.betaDy);
+    const __m128i gammaQuad = _mm_setr_epi32(0, t.gammaDx, t.gammaDy, t.gammaDx + t.gammaDy);
+    // Steps between quads
+    const __m128i alphaStepX = _mm_set1_epi32(2 * t.alphaDx), alphaStepY = _mm_set1_epi32(2 * t.alphaDy);
+    const __m128i betaStepX = _mm_set1_epi32(2 * t.betaDx), betaStepY = _mm_set1_epi32(2 * t.betaDy);
+    const __m128i gammaStepX = _mm_set1_epi32(2 * t.gammaDx), gammaStepY = _mm_set1_epi32(2 * t.gammaDy);
+
+    // Each vertex's data splatted across lanes, and the interpolated data
+    int numData = verts[0].num_data;
+    __m128 vdata[3][MAX_VERTEX_DATA];
+    __m128 data[MAX_VERTEX_DATA];
+    unsigned long long fragments = 0, rejected = 0;
+    for (int v = 0; v < 3; v++)
+        for (int i = 0; i < numData; i++)
+            vdata[v][i] = _mm_set1_ps(verts[v].data[i]);
+
+    // go over every tile in the bounding box
+    for (int ty = t.yStart / TILE_SIZE; ty * (int)TILE_SIZE < t.yMax; ty++)
+    {
+        for (int tx = t.xStart / TILE_SIZE; tx * (int)TILE_SIZE < t.xMax; tx++)
+        {
+            // Skip the whole tile if everything in it is nearer than the triangle
+            if (canv->tileOccludes(tx, ty, t.zMin))
+                continue;
+
+            // The part of the bounding box inside this tile.  Quads start on
+            // even pixels, and tiles are an even size, so quads never
+            // straddle tiles.
+            int xTile = std::max(t.xStart, tx * (int)TILE_SIZE);
+            int yTile = std::max(t.yStart, ty * (int)TILE_SIZE);
+            int yEnd = std::min(t.yMax, (ty + 1) * (int)TILE_SIZE);
+            int xEnd = std::min(t.xMax, (tx + 1) * (int)TILE_SIZE);
+            if (xTile >= xEnd || yTile >= yEnd)
+                continue;
+            int xQuad = xTile & ~1, yQuad = yTile & ~1;
+
+            // Skip tiles the triangle misses, and don't bother testing pixels
+            // in tiles it covers
+            blockCoverage coverage = classifyBlock(t, xTile, yTile, xEnd, yEnd);
+            if (coverage == BLOCK_OUTSIDE)
+                continue;
+            bool covered = coverage == BLOCK_INSIDE;
+
+            // Edge functions of the quad at the start of the current row
+            __m128i alphaRow = _mm_add_epi32(_mm_set1_epi32(f(coords[1], coords[2], xQuad, yQuad)), alphaQuad);
+            __m128i betaRow = _mm_add_epi32(_mm_set1_epi32(f(coords[2], coords[0], xQuad, yQuad)), betaQuad);
+            __m128i gammaRow = _mm_add_epi32(_mm_set1_epi32(f(coords[0], coords[1], xQuad, yQuad)), gammaQuad);
+            for (int y = yQuad; y < yEnd; y += 2)
+            {
+                __m128i fa = alphaRow, fb = betaRow, fg = gammaRow;
+                for (int x = xQuad; x < xEnd; x += 2)
+                {
+                    // calculate the pixels' barycentric coordinates
+                    __m128 alpha = _mm_div_ps(_mm_cvtepi32_ps(fa), fAlpha);
+                    __m128 beta = _mm_div_ps(_mm_cvtepi32_ps(fb), fBeta);
+                    __m128 gamma = _mm_div_ps(_mm_cvtepi32_ps(fg), fGamma);
+                    fa = _mm_add_epi32(fa, alphaStepX);
+                    fb = _mm_add_epi32(fb, betaStepX);
+                    fg = _mm_add_epi32(fg, gammaStepX);
+
+                    // pixels are only inside if the coordinates are positive
+                    int mask = covered ? 0xF : _mm_movemask_ps(_mm_and_ps(_mm_cmpge_ps(alpha, zero),
+                                _mm_and_ps(_mm_cmpge_ps(beta, zero), _mm_cmpge_ps(gamma, zero))));
+                    // and inside this tile's part of the bounding box
+                    if (x < xTile)
+                        mask &= ~0x5;
+                    if (x + 1 >= xEnd)
+                        mask &= ~0xA;
+                    if (y < yTile)
+                        mask &= ~0x3;
+                    if (y + 1 >= yEnd)
+                        mask &= ~0xC;
+                    if (!mask)
+                        continue;
+                    fragments += __builtin_popcount(mask);
+
+                    // interpolate z first, and drop the pixels that are
+                    // hidden before interpolating anything else
+                    data[2] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(alpha, vdata[0][2]),
+                                _mm_mul_ps(beta, vdata[1][2])),
+                            _mm_mul_ps(gamma, vdata[2][2]));
+                    float z[4];
+                    _mm_storeu_ps(z, data[2]);
+                    for (int i = 0; i < 4; i++)
+                        if ((mask & (1 << i)) && !canv->depthPasses(x + (i & 1), y + (i >> 1), z[i]))
+                        {
+                            mask &= ~(1 << i);
+                            rejected++;
+                        }
+                    if (!mask)
+                        continue;
+
+                    // interpolate all data
+                    for (int i = 0; i < numData; i++)
+                    {
+                        if (i == 2)
+                            continue;
+                        data[i] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(alpha, vdata[0][i]),
+                                    _mm_mul_ps(beta, vdata[1][i])),
+                                _mm_mul_ps(gamma, vdata[2][i]));
+                    }
+
+                    // and finally, draw the pixels
+                    fp(x, y, mask, data);
+                }
+
+                alphaRow = _mm_add_epi32(alphaRow, alphaStepY);
+                betaRow = _mm_add_epi32(betaRow, betaStepY);
+                gammaRow = _mm_add_epi32(gammaRow, gammaStepY);
+            }
+        }
+    }
+    addFragments<quadFragmentProcessor>(fragments, rejected);
+}
+
+// Like rasterizeTriangle, but works on 2x2 pixel quads with SSE.  The
+// fragment processor must support void (int, int, int, const __m128*).  The
+// first two ints are the pixel coordinates of the quad's top left corner,
+// the third is a coverage mask with bit i set if pixel i of the quad is in
+// the triangle and passes the depth test, where pixel i is at (x + (i & 1), y + (i >> 1)).  Lane i of
+// each __m128 is that pixel's interpolated data, again with data[2] the NDC
+// z coordinate.  Covered pixels get exactly the same data as they would from
+// rasterizeTriangle.
+    template<typename quadFragmentProcessor>
+void rasterizeTriangleQuads(const vertex verts[3], quadFragmentProcessor fp)
+{
+    triangleSetup t;
+    if (setupTriangle(verts, t))
+        rasterizeQuads(verts, t, fp, 0, 0, canv->getXRes(), canv->getYRes());
 }
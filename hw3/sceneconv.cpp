@@ -0,0 +1,38 @@
+#include <fstream>
+#include <iostream>
+#include <cstdlib>
+#include "shaded.h"
+
+void read_scene(std::istream &input, int fd, Scene *output);
+bool write_scene(const Scene &scene, const char *filename);
+
+/**
+ * Converts an Open Inventor scene to a binary scene file (scenefile.h) that
+ * shaded, wireframe and oglRenderer load without parsing.  The input can be
+ * a scene file too, which just rewrites it.
+ */
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        std::cerr << "usage: sceneconv in.iv out.scn\n";
+        exit(1);
+    }
+
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in)
+    {
+        std::cerr << "Unable to open " << argv[1] << '\n';
+        exit(1);
+    }
+    Scene scene;
+    read_scene(in, -1, &scene);
+
+    if (!write_scene(scene, argv[2]))
+    {
+        std::cerr << "Unable to write " << argv[2] << '\n';
+        exit(1);
+    }
+
+    return 0;
+}
@@ -0,0 +1,204 @@
+#include <fstream>
+#include <iostream>
+#include <cstdlib>
+#include "shaded.h"
+#include "scenefile.h"
+
+void parse_file(std::istream &input, Scene *output);
+
+static void copy_floats(float *out, const Vector3 &v)
+{
+    for (int i = 0; i < 3; i++)
+        out[i] = v(i);
+}
+
+static void copy_floats(float *out, const Vector4 &v)
+{
+    for (int i = 0; i < 4; i++)
+        out[i] = v(i);
+}
+
+/**
+ * Reads a scene from input, which can be either an Open Inventor text file or
+ * a binary scene file (scenefile.h).  fd is input's file descriptor, or -1;
+ * binary files on a regular file descriptor are mapped instead of read.
+ */
+void read_scene(std::istream &input, int fd, Scene *output)
+{
+    if (!isSceneFile(input))
+    {
+        parse_file(input, output);
+        return;
+    }
+
+    sceneFile file;
+    if (!file.load(input, fd))
+    {
+        std::cerr << "Not a scene file this can read\n";
+        exit(1);
+    }
+    const sceneFileHeader &h = file.header();
+
+    // The last camera is the one rendered from, as when parsing
+    const sceneFileCamera *cameras = file.array<sceneFileCamera>(h.camerasOffset, h.numCameras);
+    for (unsigned i = 0; i < h.numCameras; i++)
+    {
+        const sceneFileCamera &c = cameras[i];
+        Camera cam;
+        cam.position = makeVector3(c.position[0], c.position[1], c.position[2]);
+        cam.orientation = makeVector4(c.orientation[0], c.orientation[1], c.orientation[2], c.orientation[3]);
+        cam.nearDistance = c.nearDistance;
+        cam.farDistance = c.farDistance;
+        cam.left = c.left;
+        cam.right = c.right;
+        cam.top = c.top;
+        cam.bottom = c.bottom;
+        output->cameras.push_back(cam);
+        output->camera = cam;
+    }
+
+    const sceneFileLight *lights = file.array<sceneFileLight>(h.lightsOffset, h.numLights);
+    output->lights.resize(h.numLights);
+    for (unsigned i = 0; i < h.numLights; i++)
+    {
+        output->lights[i].position = makeVector3(lights[i].position[0], lights[i].position[1], lights[i].position[2]);
+        output->lights[i].color = makeVector3(lights[i].color[0], lights[i].color[1], lights[i].color[2]);
+    }
+
+    const sceneFileSeparator *seps = file.array<sceneFileSeparator>(h.separatorsOffset, h.numSeparators);
+    output->separators.resize(h.numSeparators);
+    for (unsigned s = 0; s < h.numSeparators; s++)
+    {
+        const sceneFileSeparator &in = seps[s];
+        Separator &sep = output->separators[s];
+
+        const sceneFileTransform *transforms = file.array<sceneFileTransform>(in.transformsOffset, in.numTransforms);
+        const float *points = file.array<float>(in.pointsOffset, in.numPoints * 3ull);
+        const int32_t *indices = file.array<int32_t>(in.indicesOffset, in.numIndices);
+        const float *normals = file.array<float>(in.normalsOffset, in.numNormals * 3ull);
+        const int32_t *normalindices = file.array<int32_t>(in.normalIndicesOffset, in.numNormalIndices);
+        if (!transforms || !points || !indices || !normals || !normalindices)
+        {
+            std::cerr << "Scene file is truncated\n";
+            exit(1);
+        }
+
+        sep.material.ambientColor = makeVector3(in.ambientColor[0], in.ambientColor[1], in.ambientColor[2]);
+        sep.material.diffuseColor = makeVector3(in.diffuseColor[0], in.diffuseColor[1], in.diffuseColor[2]);
+        sep.material.specularColor = makeVector3(in.specularColor[0], in.specularColor[1], in.specularColor[2]);
+        sep.material.shininess = in.shininess;
+
+        sep.transforms.resize(in.numTransforms);
+        for (unsigned i = 0; i < in.numTransforms; i++)
+        {
+            const sceneFileTransform &t = transforms[i];
+            sep.transforms[i].translation = makeVector3(t.translation[0], t.translation[1], t.translation[2]);
+            sep.transforms[i].rotation = makeVector4(t.rotation[0], t.rotation[1], t.rotation[2], t.rotation[3]);
+            sep.transforms[i].scaling = makeVector3(t.scaling[0], t.scaling[1], t.scaling[2]);
+        }
+
+        sep.points.resize(in.numPoints);
+        for (unsigned i = 0; i < in.numPoints; i++)
+            sep.points[i] = makeVector3(points[3*i], points[3*i+1], points[3*i+2]);
+        sep.normals.resize(in.numNormals);
+        for (unsigned i = 0; i < in.numNormals; i++)
+            sep.normals[i] = makeVector3(normals[3*i], normals[3*i+1], normals[3*i+2]);
+        sep.indices.assign(indices, indices + in.numIndices);
+        sep.normalindices.assign(normalindices, normalindices + in.numNormalIndices);
+    }
+}
+
+/**
+ * Writes scene to filename as a binary scene file.  Returns false if it
+ * couldn't be written.
+ */
+bool write_scene(const Scene &scene, const char *filename)
+{
+    sceneFileWriter writer;
+    sceneFileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SCENE_FILE_MAGIC, sizeof(h.magic));
+    h.version = SCENE_FILE_VERSION;
+
+    // Every camera, so that wireframe's -cameras files convert too.  A scene
+    // put together without a list of cameras still has its one.
+    std::vector<Camera> sceneCameras = scene.cameras;
+    if (sceneCameras.empty())
+        sceneCameras.push_back(scene.camera);
+    std::vector<sceneFileCamera> cameras(sceneCameras.size());
+    for (unsigned i = 0; i < cameras.size(); i++)
+    {
+        const Camera &c = sceneCameras[i];
+        copy_floats(cameras[i].position, c.position);
+        copy_floats(cameras[i].orientation, c.orientation);
+        cameras[i].nearDistance = c.nearDistance;
+        cameras[i].farDistance = c.farDistance;
+        cameras[i].left = c.left;
+        cameras[i].right = c.right;
+        cameras[i].top = c.top;
+        cameras[i].bottom = c.bottom;
+    }
+    h.numCameras = cameras.size();
+    h.camerasOffset = writer.add(&cameras[0], cameras.size());
+
+    std::vector<sceneFileLight> lights(scene.lights.size());
+    for (unsigned i = 0; i < lights.size(); i++)
+    {
+        copy_floats(lights[i].position, scene.lights[i].position);
+        copy_floats(lights[i].color, scene.lights[i].color);
+    }
+    h.numLights = lights.size();
+    h.lightsOffset = writer.add(lights.empty() ? NULL : &lights[0], lights.size());
+
+    // The separator table goes first, its offsets are filled in below
+    std::vector<sceneFileSeparator> seps(scene.separators.size());
+    h.numSeparators = seps.size();
+    h.separatorsOffset = writer.add(seps.empty() ? NULL : &seps[0], seps.size());
+    for (unsigned s = 0; s < seps.size(); s++)
+    {
+        const Separator &in = scene.separators[s];
+        sceneFileSeparator &out = seps[s];
+        memset(&out, 0, sizeof(out));
+
+        copy_floats(out.ambientColor, in.material.ambientColor);
+        copy_floats(out.diffuseColor, in.material.diffuseColor);
+        copy_floats(out.specularColor, in.material.specularColor);
+        out.shininess = in.material.shininess;
+
+        std::vector<sceneFileTransform> transforms(in.transforms.size());
+        for (unsigned i = 0; i < transforms.size(); i++)
+        {
+            copy_floats(transforms[i].translation, in.transforms[i].translation);
+            copy_floats(transforms[i].rotation, in.transforms[i].rotation);
+            copy_floats(transforms[i].scaling, in.transforms[i].scaling);
+        }
+        std::vector<float> points(in.points.size() * 3);
+        for (unsigned i = 0; i < in.points.size(); i++)
+            copy_floats(&points[3*i], in.points[i]);
+        std::vector<float> normals(in.normals.size() * 3);
+        for (unsigned i = 0; i < in.normals.size(); i++)
+            copy_floats(&normals[3*i], in.normals[i]);
+        std::vector<int32_t> indices(in.indices.begin(), in.indices.end());
+        std::vector<int32_t> normalindices(in.normalindices.begin(), in.normalindices.end());
+
+        out.numTransforms = transforms.size();
+        out.numPoints = in.points.size();
+        out.numIndices = indices.size();
+        out.numNormals = in.normals.size();
+        out.numNormalIndices = normalindices.size();
+        out.transformsOffset = writer.add(transforms.empty() ? NULL : &transforms[0], transforms.size());
+        out.pointsOffset = writer.add(points.empty() ? NULL : &points[0], points.size());
+        out.indicesOffset = writer.add(indices.empty() ? NULL : &indices[0], indices.size());
+        out.normalsOffset = writer.add(normals.empty() ? NULL : &normals[0], normals.size());
+        out.normalIndicesOffset = writer.add(normalindices.empty() ? NULL : &normalindices[0], normalindices.size());
+    }
+    if (!seps.empty())
+        writer.set(h.separatorsOffset, &seps[0], seps.size());
+
+    h.fileSize = writer.bytes().size();
+    writer.set(0, &h, 1);
+
+    std::ofstream file(filename, std::ios::binary);
+    file.write(&writer.bytes()[0], writer.bytes().size());
+    return file.good();
+}
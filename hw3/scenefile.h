@@ -0,0 +1,212 @@
+#pragma once
+#include <istream>
+#include <vector>
+#include <iterator>
+#include <cstring>
+#include <cstdlib>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Binary scene files hold the same scenes as the Open Inventor text files,
+ * laid out so they can be mapped into memory and used without parsing.
+ * Everything is little endian.  The file starts with a sceneFileHeader,
+ * followed by arrays of the structs below, each starting on a 64 byte
+ * boundary and found by its offset from the start of the file:
+ *
+ *   sceneFileHeader
+ *   sceneFileCamera[numCameras]       in file order, the last one is used
+ *   sceneFileLight[numLights]
+ *   sceneFileSeparator[numSeparators]
+ *   the arrays each separator points to
+ */
+
+// The first bytes of every scene file.  The first isn't valid text, so a
+// scene file can't be mistaken for an Open Inventor one.
+static const char SCENE_FILE_MAGIC[8] = {'\x89', 'S', 'C', 'E', 'N', 'E', '\r', '\n'};
+static const uint32_t SCENE_FILE_VERSION = 1;
+static const uint64_t SCENE_FILE_ALIGN = 64;
+
+struct sceneFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t numCameras;
+    uint32_t numLights;
+    uint32_t numSeparators;
+    uint64_t camerasOffset;
+    uint64_t lightsOffset;
+    uint64_t separatorsOffset;
+    uint64_t fileSize;
+};
+
+struct sceneFileCamera
+{
+    float position[3];
+    float orientation[4];
+    float nearDistance, farDistance;
+    float left, right, top, bottom;
+};
+
+struct sceneFileLight
+{
+    float position[3];
+    float color[3];
+};
+
+struct sceneFileTransform
+{
+    float translation[3];
+    float rotation[4];
+    float scaling[3];
+};
+
+// Points and normals are 3 floats each, indices are int32_t with -1 ending
+// each face, as in the text files
+struct sceneFileSeparator
+{
+    float ambientColor[3];
+    float diffuseColor[3];
+    float specularColor[3];
+    float shininess;
+    uint32_t numTransforms;
+    uint32_t numPoints;
+    uint32_t numIndices;
+    uint32_t numNormals;
+    uint32_t numNormalIndices;
+    uint32_t reserved;
+    uint64_t transformsOffset;
+    uint64_t pointsOffset;
+    uint64_t indicesOffset;
+    uint64_t normalsOffset;
+    uint64_t normalIndicesOffset;
+};
+
+// Returns true if input starts like a scene file.  Nothing is read.
+inline bool isSceneFile(std::istream &input)
+{
+    return input.peek() == static_cast<unsigned char>(SCENE_FILE_MAGIC[0]);
+}
+
+/**
+ * A scene file in memory, mapped if it came from a file descriptor that can
+ * be mapped and read into a buffer otherwise.  The accessors return NULL for
+ * anything that doesn't fit inside the file.
+ */
+class sceneFile
+{
+public:
+    sceneFile() : data_(NULL), size_(0), mapped_(false) {}
+
+    ~sceneFile()
+    {
+        if (mapped_)
+            munmap(data_, size_);
+        else
+            free(data_);
+    }
+
+    // Maps the file open on fd, or if that can't be done reads the rest of
+    // input.  Returns false if it isn't a scene file this can read.
+    bool load(std::istream &input, int fd)
+    {
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        {
+            void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                data_ = static_cast<char *>(p);
+                size_ = st.st_size;
+                mapped_ = true;
+                return valid();
+            }
+        }
+
+        std::vector<char> bytes((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+        if (bytes.empty() || posix_memalign(reinterpret_cast<void **>(&data_), SCENE_FILE_ALIGN, bytes.size()))
+            return false;
+        memcpy(data_, &bytes[0], bytes.size());
+        size_ = bytes.size();
+        return valid();
+    }
+
+    const sceneFileHeader &header() const
+    {
+        return *reinterpret_cast<const sceneFileHeader *>(data_);
+    }
+
+    // count Ts starting offset bytes into the file
+    template<typename T>
+    const T *array(uint64_t offset, uint64_t count) const
+    {
+        if (offset % SCENE_FILE_ALIGN != 0 || offset > size_ || count > (size_ - offset) / sizeof(T))
+            return NULL;
+        return reinterpret_cast<const T *>(data_ + offset);
+    }
+
+private:
+    char *data_;
+    size_t size_;
+    bool mapped_;
+
+    // Not copyable, it owns the memory
+    sceneFile(const sceneFile &);
+    sceneFile &operator=(const sceneFile &);
+
+    bool valid() const
+    {
+        // The structs are read in place, which needs a little endian machine
+        const uint32_t one = 1;
+        if (*reinterpret_cast<const unsigned char *>(&one) != 1)
+            return false;
+        if (size_ < sizeof(sceneFileHeader))
+            return false;
+        const sceneFileHeader &h = header();
+        return memcmp(h.magic, SCENE_FILE_MAGIC, sizeof(h.magic)) == 0 &&
+            h.version == SCENE_FILE_VERSION && h.fileSize == size_ &&
+            array<sceneFileCamera>(h.camerasOffset, h.numCameras) &&
+            array<sceneFileLight>(h.lightsOffset, h.numLights) &&
+            array<sceneFileSeparator>(h.separatorsOffset, h.numSeparators);
+    }
+};
+
+/**
+ * Builds a scene file in memory.  Arrays are appended with add, which returns
+ * their offsets, and tables that hold offsets are filled in with set once
+ * those are known.
+ */
+class sceneFileWriter
+{
+public:
+    sceneFileWriter() : bytes_(sizeof(sceneFileHeader), 0) {}
+
+    // Appends count Ts on a 64 byte boundary and returns their offset
+    template<typename T>
+    uint64_t add(const T *items, uint64_t count)
+    {
+        uint64_t offset = (bytes_.size() + SCENE_FILE_ALIGN - 1) / SCENE_FILE_ALIGN * SCENE_FILE_ALIGN;
+        bytes_.resize(offset + count * sizeof(T), 0);
+        if (count)
+            memcpy(&bytes_[offset], items, count * sizeof(T));
+        return offset;
+    }
+
+    // Overwrites what is at offset with count Ts
+    template<typename T>
+    void set(uint64_t offset, const T *items, uint64_t count)
+    {
+        memcpy(&bytes_[offset], items, count * sizeof(T));
+    }
+
+    // The finished file, after the header has been set at offset 0
+    const std::vector<char> &bytes() const
+    {
+        return bytes_;
+    }
+
+private:
+    std::vector<char> bytes_;
+};
@@ -2,21 +2,253 @@
 #include <iostream>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
 #include "shaded.h"
 #include "canvas.h"
 #include "matrix.h"
 #include "transforms.h"
 #include "raster.h"
-void parse_file(std::istream &input, Scene *output);
+#include "parallel.h"
+#include "arena.h"
+#include "stats.h"
+#include "scenefile.h"
+#include "bvh.h"
+
+renderStats *stats = NULL;
+
+// Floats of data per vertex, see simple_shader and phong_shader
+static const int NUM_DATA = 9;
+
+// A transformed and set up triangle waiting to be rasterized by bin.  They
+// live in the render pass's arena, chained in drawing order.
+struct binnedTriangle
+{
+    vertex verts[3];
+    triangleSetup setup;
+    const Material *material;
+    binnedTriangle *next;
+};
+
+// Outcode bits of a clip space vertex, set for each plane it is outside of.
+// The first six are the view frustum's.  Past the guard band planes x and y
+// are clipped too, so that pixel coordinates stay well inside int range;
+// short of them, triangles are left for the rasterizer to trim.
+static const int OUT_LEFT = 1;
+static const int OUT_RIGHT = 2;
+static const int OUT_BOTTOM = 4;
+static const int OUT_TOP = 8;
+static const int OUT_NEAR = 16;
+static const int OUT_FAR = 32;
+static const int OUT_GUARD_LEFT = 64;
+static const int OUT_GUARD_RIGHT = 128;
+static const int OUT_GUARD_BOTTOM = 256;
+static const int OUT_GUARD_TOP = 512;
+static const int OUT_FRUSTUM = OUT_LEFT | OUT_RIGHT | OUT_BOTTOM | OUT_TOP | OUT_NEAR | OUT_FAR;
+static const int OUT_CLIP = OUT_NEAR | OUT_FAR | OUT_GUARD_LEFT | OUT_GUARD_RIGHT |
+    OUT_GUARD_BOTTOM | OUT_GUARD_TOP;
+
+// Half width of the guard band in NDC
+static const float GUARD_BAND = 4;
+
+// Clipping a triangle against all six clip planes adds at most six vertices
+static const int MAX_CLIP_VERTS = 9;
+
+// Shadow rays start this far off the surface, as a fraction of the size of
+// the scene, so they don't hit the triangle they start on
+static const float SHADOW_OFFSET = 1e-4f;
+
+// Progressive ray tracing first traces one pixel in this many each way, and
+// halves it every pass
+static const int PROGRESSIVE_STEP = 8;
+
+int outcode(const Vector4 &clip);
+
+/**
+ * The lights of a frame packed for the lighting kernel, structure of arrays
+ * style with each value already repeated four times, so lighting four pixels
+ * loads them straight into SSE registers.
+ */
+struct lightBuffer
+{
+    lightBuffer(const std::vector<Light> &lights) :
+        count(lights.size()),
+        x(4 * count), y(4 * count), z(4 * count),
+        r(4 * count), g(4 * count), b(4 * count)
+    {
+        for (unsigned i = 0; i < 4 * count; i++)
+        {
+            const Light &l = lights[i / 4];
+            x[i] = l.position(0); y[i] = l.position(1); z[i] = l.position(2);
+            r[i] = l.color(0); g[i] = l.color(1); b[i] = l.color(2);
+        }
+    }
+
+    // Light i's values are [4 * i, 4 * i + 4) of each array
+    __m128 load(const std::vector<float> &v, unsigned i) const
+    {
+        return _mm_loadu_ps(&v[4 * i]);
+    }
+
+    unsigned count;
+    // Position and color of each light
+    std::vector<float> x, y, z;
+    std::vector<float> r, g, b;
+};
+
+/**
+ * Per pixel results of the deferred geometry pass: the interpolated world
+ * position and normal of the nearest fragment, and its material, which is
+ * NULL where nothing was drawn.  All the storage comes from mem.
+ */
+struct gBuffer
+{
+    gBuffer(int xres, int yres, arena &mem) :
+        xres(xres),
+        yres(yres)
+    {
+        world = mem.allocateArray<float>(3 * xres * yres);
+        normal = mem.allocateArray<float>(3 * xres * yres);
+        material = mem.allocateArray<const Material *>(xres * yres);
+        std::fill(material, material + xres * yres, static_cast<const Material *>(NULL));
+    }
+
+    int xres, yres;
+    // Three floats per pixel
+    float *world;
+    float *normal;
+    const Material **material;
+};
+
+// What the ray through a pixel hit, kept between progressive passes
+struct traceSample
+{
+    bool hit;
+    float z;
+    Vector3 color;
+};
+
+/**
+ * Transformed vertices of one separator's mesh.  Each vertex is transformed
+ * once, the first time a triangle uses it, and every triangle sharing it
+ * reads the cached result.
+ */
+class vertexCache
+{
+public:
+    struct entry
+    {
+        Vector4 clip;
+        int outcode;
+        Vector3 ndc;
+        Vector3 world;
+        Vector3 normal;
+        // Gouraud lighting, only worked out once a front facing triangle
+        // uses the vertex
+        Vector3 color;
+        bool lit;
+        bool transformed;
+    };
+
+    // All of the cache's storage comes from mem, which must outlive it
+    vertexCache(const Mesh &mesh, const Matrix4 &modelViewProjectionMatrix,
+            const Matrix4 &modelMatrix, const Matrix4 &normalMatrix, arena &mem) :
+        mesh_(mesh),
+        modelViewProjectionMatrix_(modelViewProjectionMatrix),
+        modelMatrix_(modelMatrix),
+        normalMatrix_(normalMatrix)
+    {
+        entries_ = mem.allocateArray<entry>(mesh.points.size());
+        for (unsigned i = 0; i < mesh.points.size(); i++)
+            entries_[i].transformed = false;
+    }
+
+    // Returns vertex v, transforming it if this is the first time it's been
+    // asked for
+    entry &fetch(int v)
+    {
+        entry &e = entries_[v];
+        if (e.transformed)
+            return e;
+
+        const Vector3 &point = mesh_.points[v];
+        Vector4 coord = modelViewProjectionMatrix_ * homogenize(point);
+        e.clip = coord;
+        e.outcode = outcode(coord);
+        coord /= coord(3);
+        e.ndc = makeVector3(coord(0), coord(1), coord(2));
+
+        coord = modelMatrix_ * homogenize(point);
+        coord /= coord(3);
+        e.world = makeVector3(coord(0), coord(1), coord(2));
+
+        Vector4 norm = normalMatrix_ * homogenize(mesh_.normals[v]);
+        norm /= norm(3);
+        // Use a shortcut to normalize
+        norm(3) = 0; norm.normalize();
+        e.normal = makeVector3(norm(0), norm(1), norm(2));
+        e.lit = false;
+        e.transformed = true;
+        return e;
+    }
+
+private:
+    const Mesh &mesh_;
+    const Matrix4 &modelViewProjectionMatrix_;
+    const Matrix4 &modelMatrix_;
+    const Matrix4 &normalMatrix_;
+
+    entry *entries_;
+};
+
+void read_scene(std::istream &input, int fd, Scene *output);
+bool write_scene(const Scene &scene, const char *filename);
+
+bool frontFacing(const Vector3 &v0, const Vector3 &v1, const Vector3 &v2);
+int clip_polygon(Vector4 pos[MAX_CLIP_VERTS], vertex verts[MAX_CLIP_VERTS], int n, int planes);
 
 void print_scene_info(const Scene &scene);
-void render_scene(const Scene &scene, Canvas &canv, int shadingMode, bool eyelight);
+void compute_bounds(Separator &sep);
+void build_mesh(Separator &sep);
+void build_lods(Separator &sep);
+const Mesh &select_lod(const Separator &sep, const Matrix4 &objectToClip, int xRes, int yRes,
+        float maxPixels);
+bool outside_frustum(const Separator &sep, const Matrix4 &objectToClip);
+void render_scene(const Scene &scene, Canvas &canv, int shadingMode, bool eyelight,
+        unsigned numThreads, bool prepass, bool deferred, float lodPixels, bool raytrace,
+        bool shadows, double deadline, const std::function<void()> &passDone);
+template<int SHADING>
+void render_dispatch(const Scene &scene, Canvas &canv, const Matrix4 &viewProjectionMatrix,
+        const lightBuffer &lights, const Vector3 &cameraPos, unsigned numThreads,
+        bool prepass, bool deferred, float lodPixels, bool raytrace, bool shadows,
+        double deadline, const std::function<void()> &passDone);
+template<int SHADING, int NUM_LIGHTS>
+void render_pipeline(const Scene &scene, Canvas &canv, const Matrix4 &viewProjectionMatrix,
+        const lightBuffer &lights, const Vector3 &cameraPos, unsigned numThreads,
+        bool prepass, bool deferred, float lodPixels);
+template<int SHADING, int NUM_LIGHTS>
+void raytrace_pipeline(const Scene &scene, Canvas &canv, const Matrix4 &viewProjectionMatrix,
+        const lightBuffer &lights, const Vector3 &cameraPos, unsigned numThreads, bool shadows,
+        double deadline, const std::function<void()> &passDone);
+template<int SHADING, int NUM_LIGHTS>
+void render_binned(const binnedTriangle *triangles, Canvas &canv,
+        const lightBuffer &lights, const Vector3 &cameraPos, unsigned numThreads,
+        bool prepass, gBuffer *gbuf, arena &mem);
+template<int NUM_LIGHTS>
+void shade_deferred(const gBuffer &gbuf, Canvas &canv, const lightBuffer &lights,
+        const Vector3 &cameraPos, unsigned numThreads);
 Matrix4 getCameraTransform(const Scene &scene);
 Matrix4 worldToNDCMatrix(const Scene &scene);
 Matrix4 createModelMatrix(const Transform &);
 Matrix4 createNormalMatrix(const Transform &);
+// NUM_LIGHTS is the number of lights if it is known at compile time, or 0.
+// visible, if given, is how much of each light gets through, for shadows.
+template<int NUM_LIGHTS = 0>
 Vector3 lightFunc(const Vector3 &pos, const Vector3 &normal, const Material &material,
-        const std::vector<Light>& lights, const Vector3 &camerapos);
+        const lightBuffer &lights, const Vector3 &camerapos, const float *visible = NULL);
+template<int NUM_LIGHTS = 0>
+void lightFunc4(const __m128 pos[3], const __m128 normal[3], const Material &material,
+        const lightBuffer &lights, const Vector3 &camerapos, __m128 color[3],
+        const float *visible = NULL);
 
 static const int FLAT = 0;
 static const int GOURAUD = 1;
@@ -24,9 +256,11 @@ static const int PHONG = 2;
 
 int main(int argc, char **argv)
 {
-    if (argc != 4 && argc != 5)
+    if (argc < 4)
     {
-        std::cerr << "usage: shaded n xRes yRes [-eyelight]\n";
+        std::cerr << "usage: shaded n xRes yRes [-eyelight] [-depth16 | -depth24] [-threads n] [-prepass] [-deferred]"
+            " [-stats file.json] [-cache file.scn] [-lod pixels] [-raytrace] [-shadows]"
+            " [-progressive seconds]\n";
         exit(1);
     }
     int lightMode, xRes, yRes;
@@ -35,7 +269,51 @@ int main(int argc, char **argv)
     yRes = atoi(argv[3]);
     
     bool eyelight = false;
-    eyelight = argc == 5 && strcmp(argv[4], "-eyelight") == 0;
+    DepthFormat depthFormat = DEPTH_FLOAT;
+    unsigned numThreads = 1;
+    bool prepass = false;
+    bool deferred = false;
+    const char *statsFile = NULL;
+    const char *cacheFile = NULL;
+    float lodPixels = 0;
+    bool raytrace = false;
+    bool shadows = false;
+    double budget = 0;
+    for (int i = 4; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-eyelight") == 0)
+            eyelight = true;
+        else if (strcmp(argv[i], "-depth16") == 0)
+            depthFormat = DEPTH_16;
+        else if (strcmp(argv[i], "-depth24") == 0)
+            depthFormat = DEPTH_24;
+        else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+            numThreads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-prepass") == 0)
+            prepass = true;
+        else if (strcmp(argv[i], "-deferred") == 0)
+            deferred = true;
+        else if ((strcmp(argv[i], "-stats") == 0 || strcmp(argv[i], "--stats") == 0) && i + 1 < argc)
+            statsFile = argv[++i];
+        else if (strcmp(argv[i], "-cache") == 0 && i + 1 < argc)
+            cacheFile = argv[++i];
+        else if (strcmp(argv[i], "-lod") == 0 && i + 1 < argc)
+            lodPixels = atof(argv[++i]);
+        else if (strcmp(argv[i], "-raytrace") == 0)
+            raytrace = true;
+        else if (strcmp(argv[i], "-shadows") == 0)
+            raytrace = shadows = true;
+        else if (strcmp(argv[i], "-progressive") == 0 && i + 1 < argc)
+        {
+            budget = atof(argv[++i]);
+            raytrace = true;
+        }
+        else
+        {
+            std::cerr << "Unknown option: " << argv[i] << '\n';
+            exit(1);
+        }
+    }
 
     if (lightMode != FLAT && lightMode != GOURAUD && lightMode != PHONG)
     {
@@ -43,30 +321,86 @@ int main(int argc, char **argv)
         exit(1);
     }
 
+    renderStats collected;
+    if (statsFile)
+        stats = &collected;
+
+    double start = statsClock();
+    // The budget counts from here, parsing included
+    const double deadline = budget > 0 ? start + budget : 0;
     Scene scene;
-    parse_file(std::cin, &scene);
+    bool parsed = !isSceneFile(std::cin);
+    read_scene(std::cin, 0, &scene);
+    for (unsigned i = 0; i < scene.separators.size(); i++)
+    {
+        compute_bounds(scene.separators[i]);
+        build_mesh(scene.separators[i]);
+        if (lodPixels > 0)
+            build_lods(scene.separators[i]);
+    }
+    collected.parse = statsClock() - start;
+
+    // Save the parsed scene so later runs can skip parsing
+    if (cacheFile && parsed && !write_scene(scene, cacheFile))
+        std::cerr << "Unable to write " << cacheFile << '\n';
 
     // Canvas dimensions are NDC
-    Canvas canv(-1, 1, -1, 1, xRes, yRes);
+    Canvas canv(-1, 1, -1, 1, xRes, yRes, depthFormat);
+
+    // Progressive passes are each written as they finish, one PPM after
+    // another, and the final image is the last of them
+    auto writeImage = [&]()
+    {
+        double start = statsClock();
+        canv.display(std::cout, 255);
+        std::cout.flush();
+        collected.output += statsClock() - start;
+    };
 
     //print_scene_info(scene);
-    render_scene(scene, canv, lightMode, eyelight);
+    render_scene(scene, canv, lightMode, eyelight, numThreads, prepass, deferred, lodPixels,
+            raytrace, shadows, deadline, writeImage);
 
     //std::fstream file("shaded.ppm", std::fstream::out);
-    canv.display(std::cout, 255);
+    if (!deadline)
+        writeImage();
     //file.close();
 
+    if (stats)
+    {
+        collected.pixels = canv.coveredPixels();
+        collected.print(std::cerr);
+        std::ofstream json(statsFile);
+        collected.printJSON(json);
+        if (!json)
+            std::cerr << "Couldn't write stats to " << statsFile << '\n';
+    }
+
     return 0;
 }
 
 /**
  * This fragment processor does no extra processing.
  * It expects the data to be like positions data[0-2] and color data[3-5].
+ * It works both per pixel and per quad.
  */
 struct simple_shader
 {
     simple_shader(Canvas &canv) : canvas(canv) {}
 
+    void operator()(int x, int y, int mask, const __m128 *data)
+    {
+        float z[4], r[4], g[4], b[4];
+        _mm_storeu_ps(z, data[2]);
+        _mm_storeu_ps(r, data[3]);
+        _mm_storeu_ps(g, data[4]);
+        _mm_storeu_ps(b, data[5]);
+
+        for (int i = 0; i < 4; i++)
+            if (mask & (1 << i))
+                canvas.drawPixel(x + (i & 1), y + (i >> 1), z[i], r[i], g[i], b[i]);
+    }
+
     void operator()(int x, int y, float *data)
     {
         /*
@@ -86,12 +420,14 @@ private:
 /**
  * This FragmentProcessor implements phong shading.  It expects the data to
  * include (x, y, z) ndc positions (0-2) and world position (3-5) and finally
- * the normal vector (6-8).
+ * the normal vector (6-8).  It works both per pixel and per quad, lighting
+ * the four pixels of a quad together.  See lightFunc for NUM_LIGHTS.
  */
+template<int NUM_LIGHTS>
 struct phong_shader
 {
     phong_shader(Canvas &canv, const Material &material,
-            const std::vector<Light>& lights, const Vector3 &cameraPos) :
+            const lightBuffer &lights, const Vector3 &cameraPos) :
         canvas_(canv),
         material_(material),
         lights_(lights),
@@ -102,24 +438,139 @@ struct phong_shader
     {
         Vector3 worldCoord = makeVector3(data[3], data[4], data[5]);
         Vector3 normal = makeVector3(data[6], data[7], data[8]);
-        Vector3 color = lightFunc(worldCoord, normal, material_, lights_, cameraPos_);
+        Vector3 color = lightFunc<NUM_LIGHTS>(worldCoord, normal, material_, lights_, cameraPos_);
 
         canvas_.drawPixel(x, y, data[2], color(0), color(1), color(2));
     }
 
+    void operator()(int x, int y, int mask, const __m128 *data)
+    {
+        __m128 color[3];
+        lightFunc4<NUM_LIGHTS>(data + 3, data + 6, material_, lights_, cameraPos_, color);
+
+        float z[4], r[4], g[4], b[4];
+        _mm_storeu_ps(z, data[2]);
+        _mm_storeu_ps(r, color[0]);
+        _mm_storeu_ps(g, color[1]);
+        _mm_storeu_ps(b, color[2]);
+
+        for (int i = 0; i < 4; i++)
+            if (mask & (1 << i))
+                canvas_.drawPixel(x + (i & 1), y + (i >> 1), z[i], r[i], g[i], b[i]);
+    }
+
 private:
     Canvas &canvas_;
     const Material &material_;
-    const std::vector<Light> &lights_;
+    const lightBuffer &lights_;
     const Vector3 &cameraPos_;
 };
 
-void render_scene(const Scene &scene, Canvas &canv, int shadingMode, bool eyelight)
+/**
+ * This fragment processor only fills in the z buffer, for the depth prepass.
+ * It only needs the z coordinate in data[2].
+ */
+struct depth_writer
+{
+    depth_writer(Canvas &canv) : canvas(canv) {}
+
+    void operator()(int x, int y, int mask, const __m128 *data)
+    {
+        float z[4];
+        _mm_storeu_ps(z, data[2]);
+
+        for (int i = 0; i < 4; i++)
+            if (mask & (1 << i))
+                canvas.drawDepth(x + (i & 1), y + (i >> 1), z[i]);
+    }
+
+    void operator()(int x, int y, float *data)
+    {
+        canvas.drawDepth(x, y, data[2]);
+    }
+
+private:
+    Canvas &canvas;
+};
+
+// The shading pass after a prepass sees the same fragments again
+template<>
+struct countsFragments<depth_writer>
+{
+    static const bool value = false;
+};
+
+/**
+ * This fragment processor fills in the g-buffer for deferred phong shading,
+ * and the z buffer.  It expects the same data as phong_shader.  The
+ * rasterizer only hands it fragments that pass the depth test, so whatever
+ * it writes is the nearest fragment so far.
+ */
+struct gbuffer_writer
+{
+    gbuffer_writer(Canvas &canv, gBuffer &gbuf, const Material &material) :
+        canvas_(canv),
+        gbuf_(gbuf),
+        material_(material)
+    {}
+
+    void operator()(int x, int y, float *data)
+    {
+        canvas_.drawDepth(x, y, data[2]);
+
+        int i = y * gbuf_.xres + x;
+        std::copy(data + 3, data + 6, gbuf_.world + 3 * i);
+        std::copy(data + 6, data + 9, gbuf_.normal + 3 * i);
+        gbuf_.material[i] = &material_;
+    }
+
+    void operator()(int x, int y, int mask, const __m128 *data)
+    {
+        float lanes[NUM_DATA][4];
+        for (int d = 0; d < NUM_DATA; d++)
+            _mm_storeu_ps(lanes[d], data[d]);
+
+        for (int i = 0; i < 4; i++)
+        {
+            if (!(mask & (1 << i)))
+                continue;
+            float pixel[NUM_DATA];
+            for (int d = 0; d < NUM_DATA; d++)
+                pixel[d] = lanes[d][i];
+            (*this)(x + (i & 1), y + (i >> 1), pixel);
+        }
+    }
+
+private:
+    Canvas &canvas_;
+    gBuffer &gbuf_;
+    const Material &material_;
+};
+
+/**
+ * Renders the scene.  With one thread every triangle is rasterized as soon as
+ * it is transformed.  With more, or with the depth prepass, triangles are set
+ * up and collected first, and then drawn by render_binned.  Deferred phong
+ * shading rasterizes into a g-buffer instead, and lights each visible pixel
+ * once afterwards in shade_deferred.  All give exactly the same image.
+ * Separators are drawn from the simplest of their LODs (build_lods) that is
+ * off by at most lodPixels pixels on screen, or in full if that's 0.
+ *
+ * With raytrace set, the scene is ray traced by raytrace_pipeline instead,
+ * always in full and with hard shadows if shadows is set.  A deadline makes
+ * it trace in progressively finer passes until it runs out of time, calling
+ * passDone after each.
+ *
+ * The work is done by render_pipeline, which is compiled separately for each
+ * shading mode and for small numbers of lights.  This picks the right one.
+ */
+void render_scene(const Scene &scene, Canvas &canv, int shadingMode, bool eyelight,
+        unsigned numThreads, bool prepass, bool deferred, float lodPixels, bool raytrace,
+        bool shadows, double deadline, const std::function<void()> &passDone)
 {
     initRaster(&canv);
     const Matrix4 viewProjectionMatrix = worldToNDCMatrix(scene);
     const Vector3 cameraPos = scene.camera.position;
-    std::cerr << "CameraPos:\n" << cameraPos;
     std::vector<Light> lights = scene.lights;
 
     // Eyelight, is a dim light set at the camera position
@@ -133,10 +584,143 @@ void render_scene(const Scene &scene, Canvas &canv, int shadingMode, bool eyelig
         lights.push_back(l);
     }
 
+    const lightBuffer lightBuf(lights);
+    switch (shadingMode)
+    {
+        case FLAT:
+            render_dispatch<FLAT>(scene, canv, viewProjectionMatrix, lightBuf, cameraPos,
+                    numThreads, prepass, deferred, lodPixels, raytrace, shadows,
+                    deadline, passDone);
+            break;
+        case GOURAUD:
+            render_dispatch<GOURAUD>(scene, canv, viewProjectionMatrix, lightBuf, cameraPos,
+                    numThreads, prepass, deferred, lodPixels, raytrace, shadows,
+                    deadline, passDone);
+            break;
+        case PHONG:
+            render_dispatch<PHONG>(scene, canv, viewProjectionMatrix, lightBuf, cameraPos,
+                    numThreads, prepass, deferred, lodPixels, raytrace, shadows,
+                    deadline, passDone);
+            break;
+    }
+}
+
+/**
+ * Picks the render_pipeline, or raytrace_pipeline, for SHADING and the number
+ * of lights.
+ */
+template<int SHADING>
+void render_dispatch(const Scene &scene, Canvas &canv, const Matrix4 &viewProjectionMatrix,
+        const lightBuffer &lights, const Vector3 &cameraPos, unsigned numThreads,
+        bool prepass, bool deferred, float lodPixels, bool raytrace, bool shadows,
+        double deadline, const std::function<void()> &passDone)
+{
+    switch (lights.count)
+    {
+        case 1:
+            if (raytrace)
+                raytrace_pipeline<SHADING, 1>(scene, canv, viewProjectionMatrix, lights, cameraPos,
+                        numThreads, shadows, deadline, passDone);
+            else
+                render_pipeline<SHADING, 1>(scene, canv, viewProjectionMatrix, lights, cameraPos,
+                        numThreads, prepass, deferred, lodPixels);
+            break;
+        case 2:
+            if (raytrace)
+                raytrace_pipeline<SHADING, 2>(scene, canv, viewProjectionMatrix, lights, cameraPos,
+                        numThreads, shadows, deadline, passDone);
+            else
+                render_pipeline<SHADING, 2>(scene, canv, viewProjectionMatrix, lights, cameraPos,
+                        numThreads, prepass, deferred, lodPixels);
+            break;
+        case 3:
+            if (raytrace)
+                raytrace_pipeline<SHADING, 3>(scene, canv, viewProjectionMatrix, lights, cameraPos,
+                        numThreads, shadows, deadline, passDone);
+            else
+                render_pipeline<SHADING, 3>(scene, canv, viewProjectionMatrix, lights, cameraPos,
+                        numThreads, prepass, deferred, lodPixels);
+            break;
+        case 4:
+            if (raytrace)
+                raytrace_pipeline<SHADING, 4>(scene, canv, viewProjectionMatrix, lights, cameraPos,
+                        numThreads, shadows, deadline, passDone);
+            else
+                render_pipeline<SHADING, 4>(scene, canv, viewProjectionMatrix, lights, cameraPos,
+                        numThreads, prepass, deferred, lodPixels);
+            break;
+        default:
+            if (raytrace)
+                raytrace_pipeline<SHADING, 0>(scene, canv, viewProjectionMatrix, lights, cameraPos,
+                        numThreads, shadows, deadline, passDone);
+            else
+                render_pipeline<SHADING, 0>(scene, canv, viewProjectionMatrix, lights, cameraPos,
+                        numThreads, prepass, deferred, lodPixels);
+            break;
+    }
+}
+
+/**
+ * Renders the scene for render_scene with shading mode SHADING.  NUM_LIGHTS
+ * is lights.count, or 0 if that isn't fixed at compile time.
+ */
+template<int SHADING, int NUM_LIGHTS>
+void render_pipeline(const Scene &scene, Canvas &canv, const Matrix4 &viewProjectionMatrix,
+        const lightBuffer &lights, const Vector3 &cameraPos, unsigned numThreads,
+        bool prepass, bool deferred, float lodPixels)
+{
+    // Memory for the whole pass, and for the separator being transformed.
+    // Once these have grown to fit, triangles take no heap allocations.
+    arena passArena;
+    arena separatorArena;
+
+    // Only used when binning, the chain of triangles in drawing order
+    const bool binning = numThreads > 1 || prepass;
+    binnedTriangle *triangles = NULL;
+    binnedTriangle **lastTriangle = &triangles;
+
+    // Only phong shading has per pixel lighting to defer
+    gBuffer *gbuf = NULL;
+    if (deferred && SHADING == PHONG)
+        gbuf = new (passArena.allocateArray<gBuffer>(1)) gBuffer(canv.getXRes(), canv.getYRes(), passArena);
+
+    // Time spent rasterizing while transforming, only counted with stats on
+    double rasterTime = 0;
+
+    // Rasterizes, or saves for later, a triangle that's already in NDC
+    auto drawTriangle = [&](const vertex verts[3], const Material &material)
+    {
+        double start = stats ? statsClock() : 0;
+        // Save it for later
+        if (binning)
+        {
+            triangleSetup setup;
+            if (setupTriangle(verts, setup))
+            {
+                binnedTriangle *tri = passArena.allocateArray<binnedTriangle>(1);
+                std::copy(verts, verts + 3, tri->verts);
+                tri->setup = setup;
+                tri->material = &material;
+                tri->next = NULL;
+                *lastTriangle = tri;
+                lastTriangle = &tri->next;
+            }
+        }
+        // RASTERIZE GO
+        else if (gbuf)
+            rasterizeTriangleQuads(verts, gbuffer_writer(canv, *gbuf, material));
+        else if (SHADING == PHONG)
+            rasterizeTriangleQuads(verts, phong_shader<NUM_LIGHTS>(canv, material, lights, cameraPos));
+        else
+            rasterizeTriangleQuads(verts, simple_shader(canv));
+        if (stats && !binning)
+            rasterTime += statsClock() - start;
+    };
+
+    double start = statsClock();
     std::vector<Separator>::const_iterator it = scene.separators.begin();
     for (; it != scene.separators.end(); it++)
     {
-        std::cerr << " --- SEPARATOR ---\n";
         Matrix4 modelMatrix = make_identity<float,4>();
         Matrix4 normalMatrix = make_identity<float,4>();
         for (unsigned i = 0; i < it->transforms.size(); i++)
@@ -145,139 +729,703 @@ void render_scene(const Scene &scene, Canvas &canv, int shadingMode, bool eyelig
             normalMatrix = normalMatrix * createNormalMatrix(it->transforms[i]);
         }
         const Matrix4 modelViewProjectionMatrix = viewProjectionMatrix * modelMatrix;
+        // Don't bother with separators that are entirely off screen
+        if (outside_frustum(*it, modelViewProjectionMatrix))
+        {
+            if (stats)
+            {
+                unsigned long long count = it->mesh.triangles.size() / 3;
+                stats->triangles += count;
+                stats->frustumCulled += count;
+            }
+            continue;
+        }
 
-        std::cerr << "Model to world space matrix:\n" << modelMatrix;
-        std::cerr << "World to NDC matrix:\n" << viewProjectionMatrix;
-        std::cerr << "Full transform matrix:\n" << modelViewProjectionMatrix;
-        std::cerr << "Normal matrix:\n" << normalMatrix;
-
+        // The simplest mesh that's off by at most lodPixels
+        const Mesh &mesh = select_lod(*it, modelViewProjectionMatrix, canv.getXRes(), canv.getYRes(), lodPixels);
 
-        const std::vector<Vector3>& points = it->points;
-        const std::vector<int>& indices = it->indices;
-        const std::vector<Vector3>& normals = it->normals;
-        const std::vector<int>& normindices = it->normalindices;
+        separatorArena.reset();
+        vertexCache cache(mesh, modelViewProjectionMatrix, modelMatrix, normalMatrix, separatorArena);
 
-        int firstInd = -1;
-        int prevInd = -1;
-        int firstNormi = -1;
-        int prevNormi = -1;
-        for (unsigned i = 0; i < indices.size(); i++)
+        const std::vector<int> &triangles = mesh.triangles;
+        for (unsigned t = 0; t < triangles.size(); t += 3)
         {
-            int ind = indices[i];
-            int normi = normindices[i];
-            // ending index -> reset
-            if (ind == -1)
+            vertexCache::entry *tri[3] = {&cache.fetch(triangles[t]), &cache.fetch(triangles[t + 1]),
+                &cache.fetch(triangles[t + 2])};
+            if (stats)
+                stats->triangles++;
+
+            // Nothing to draw if all of the triangle is outside one of
+            // the frustum's planes
+            if (tri[0]->outcode & tri[1]->outcode & tri[2]->outcode & OUT_FRUSTUM)
+            {
+                if (stats)
+                    stats->frustumCulled++;
+                continue;
+            }
+            // Triangles crossing the near or far planes, or leaving the
+            // guard band, have to be clipped in clip space first.  Their
+            // NDC coordinates can't be trusted for backface culling.
+            int clipPlanes = (tri[0]->outcode | tri[1]->outcode | tri[2]->outcode) & OUT_CLIP;
+
+            // Check for backface culling
+            if (!clipPlanes && !frontFacing(tri[0]->ndc, tri[1]->ndc, tri[2]->ndc))
+            {
+                if (stats)
+                    stats->backfaceCulled++;
+                continue;
+            }
+
+            Vector3 color;
+            // Calculate lighting once (FLAT)
+            if (SHADING == FLAT)
+                color = lightFunc<NUM_LIGHTS>((tri[0]->world + tri[1]->world + tri[2]->world)/3.0f,
+                        (tri[0]->normal + tri[1]->normal + tri[2]->normal) / 3.0f, it->material, lights, cameraPos);
+
+            vertex verts[3];
+            // Create vertices
+            for (int i = 0; i < 3; i++)
+            {
+                const Vector3 &worldCoord = tri[i]->world;
+                const Vector3 &ndcCoord = tri[i]->ndc;
+                const Vector3 &normal = tri[i]->normal;
+
+                // Calculate the lighting (GOURUAD), once per vertex
+                if (SHADING == GOURAUD)
+                {
+                    if (!tri[i]->lit)
+                    {
+                        tri[i]->color = lightFunc<NUM_LIGHTS>(worldCoord, normal, it->material, lights, cameraPos);
+                        tri[i]->lit = true;
+                    }
+                    color = tri[i]->color;
+                }
+
+                // Then stuff the vertex structure
+                // The data differs for flat/gouraud vs phong  see the
+                // definitions of simple_shader and phong_shader
+                verts[i].num_data = NUM_DATA;
+                verts[i].data[0] = ndcCoord(0);
+                verts[i].data[1] = ndcCoord(1);
+                verts[i].data[2] = ndcCoord(2);
+                verts[i].data[3] = SHADING == PHONG ? worldCoord(0) : color(0);
+                verts[i].data[4] = SHADING == PHONG ? worldCoord(1) : color(1);
+                verts[i].data[5] = SHADING == PHONG ? worldCoord(2) : color(2);
+                verts[i].data[6] = normal(0);
+                verts[i].data[7] = normal(1);
+                verts[i].data[8] = normal(2);
+            }
+
+            if (!clipPlanes)
             {
-                firstInd = prevInd = -1;
-                firstNormi = prevNormi = -1;
+                drawTriangle(verts, it->material);
+                continue;
             }
-            // first index -> just record index
-            else if (firstInd == -1)
+
+            // Clip, and draw the resulting polygon as a fan
+            Vector4 clipPos[MAX_CLIP_VERTS];
+            vertex clipVerts[MAX_CLIP_VERTS];
+            for (int i = 0; i < 3; i++)
             {
-                firstInd = ind;
-                firstNormi = normi;
+                clipPos[i] = tri[i]->clip;
+                clipVerts[i] = verts[i];
             }
-            // first index recorded, but not second -> just record second
-            else if (prevInd == -1)
+            int n = clip_polygon(clipPos, clipVerts, 3, clipPlanes);
+            // Clipping away everything counts as outside the frustum, and
+            // a polygon with no front facing pieces as backface culled
+            if (stats && n < 3)
+                stats->frustumCulled++;
+            bool drawn = false;
+            for (int i = 0; i < n; i++)
             {
-                prevInd = ind;
-                prevNormi = normi;
+                clipVerts[i].data[0] = clipPos[i](0) / clipPos[i](3);
+                clipVerts[i].data[1] = clipPos[i](1) / clipPos[i](3);
+                clipVerts[i].data[2] = clipPos[i](2) / clipPos[i](3);
             }
-            // both first and second indices recorded -> rasterize triange
-            else
+            for (int i = 1; i + 1 < n; i++)
             {
-                // Cache points
-                Vector3 worldCoords[3] = {points[firstInd], points[prevInd], points[ind]};
-                Vector3 ndcCoords[3] = {points[firstInd], points[prevInd], points[ind]};
-                Vector3 norms[3] = {normals[firstNormi], normals[prevNormi], normals[normi]};
-                // And update indexes
-                prevInd = ind;
-                prevNormi = normi;
-                // Transform the points, do this now so we can check for backface culling
-                for (int i = 0; i < 3; i++)
+                vertex fan[3] = {clipVerts[0], clipVerts[i], clipVerts[i + 1]};
+                if (frontFacing(makeVector3(fan[0].data[0], fan[0].data[1], 0),
+                            makeVector3(fan[1].data[0], fan[1].data[1], 0),
+                            makeVector3(fan[2].data[0], fan[2].data[1], 0)))
                 {
-                    Vector4 coord = modelViewProjectionMatrix * homogenize(ndcCoords[i]);
-                    coord /= coord(3);
-                    ndcCoords[i] = makeVector3(coord(0), coord(1), coord(2));
+                    drawTriangle(fan, it->material);
+                    drawn = true;
+                }
+            }
+            if (stats && n >= 3 && !drawn)
+                stats->backfaceCulled++;
+        }
+    }
+
+    double end = statsClock();
+    if (stats)
+    {
+        stats->transform = end - start - rasterTime;
+        stats->raster = rasterTime;
+    }
+
+    start = end;
+    if (binning)
+        render_binned<SHADING, NUM_LIGHTS>(triangles, canv, lights, cameraPos, numThreads,
+                prepass, gbuf, passArena);
+    end = statsClock();
+    if (stats)
+        stats->raster += end - start;
 
-                    coord = modelMatrix * homogenize(worldCoords[i]);
-                    coord /= coord(3);
-                    worldCoords[i] = makeVector3(coord(0), coord(1), coord(2));
+    start = end;
+    if (gbuf)
+    {
+        shade_deferred<NUM_LIGHTS>(*gbuf, canv, lights, cameraPos, numThreads);
+        if (stats)
+            stats->deferredShading = statsClock() - start;
+    }
+}
+
+/**
+ * Renders the scene for render_scene by casting a ray through the center of
+ * each pixel instead of rasterizing.  Every separator's full mesh goes into
+ * one bvh in world space, and squares of pixels are traced in parallel.  With
+ * shadows, a light only reaches a point if nothing is in the way, and each
+ * lit point casts a ray at every light to find out.  SHADING and NUM_LIGHTS
+ * are as for render_pipeline.
+ *
+ * With a deadline (a statsClock time, or 0 for none) the image is traced
+ * progressively, coarsest first, calling passDone after each pass with the
+ * canvas showing everything traced so far.  Every pass only traces pixels
+ * no earlier pass did, so the last is as fast as tracing in one go.
+ */
+template<int SHADING, int NUM_LIGHTS>
+void raytrace_pipeline(const Scene &scene, Canvas &canv, const Matrix4 &viewProjectionMatrix,
+        const lightBuffer &lights, const Vector3 &cameraPos, unsigned numThreads, bool shadows,
+        double deadline, const std::function<void()> &passDone)
+{
+    double start = statsClock();
+
+    // Every triangle in world space, with its material.  Without shadows
+    // flat and gouraud lighting are the same for every pixel of a triangle,
+    // so they're worked out here like the rasterizer does.
+    std::vector<Vector3> points, normals, colors;
+    std::vector<int> triangles;
+    std::vector<const Material *> materials;
+    std::vector<Separator>::const_iterator it = scene.separators.begin();
+    for (; it != scene.separators.end(); it++)
+    {
+        Matrix4 modelMatrix = make_identity<float,4>();
+        Matrix4 normalMatrix = make_identity<float,4>();
+        for (unsigned i = 0; i < it->transforms.size(); i++)
+        {
+            modelMatrix = modelMatrix * createModelMatrix(it->transforms[i]);
+            normalMatrix = normalMatrix * createNormalMatrix(it->transforms[i]);
+        }
+
+        const Mesh &mesh = it->mesh;
+        int first = points.size();
+        for (unsigned v = 0; v < mesh.points.size(); v++)
+        {
+            Vector4 coord = modelMatrix * homogenize(mesh.points[v]);
+            coord /= coord(3);
+            points.push_back(makeVector3(coord(0), coord(1), coord(2)));
+
+            Vector4 norm = normalMatrix * homogenize(mesh.normals[v]);
+            norm /= norm(3);
+            norm(3) = 0; norm.normalize();
+            normals.push_back(makeVector3(norm(0), norm(1), norm(2)));
+
+            if (SHADING == GOURAUD && !shadows)
+                colors.push_back(lightFunc<NUM_LIGHTS>(points.back(), normals.back(), it->material,
+                            lights, cameraPos));
+        }
+        for (unsigned t = 0; t < mesh.triangles.size(); t += 3)
+        {
+            const int *tri = &mesh.triangles[t];
+            for (int i = 0; i < 3; i++)
+                triangles.push_back(first + tri[i]);
+            materials.push_back(&it->material);
+
+            if (SHADING == FLAT && !shadows)
+                colors.push_back(lightFunc<NUM_LIGHTS>(
+                            (points[first + tri[0]] + points[first + tri[1]] + points[first + tri[2]]) / 3.0f,
+                            (normals[first + tri[0]] + normals[first + tri[1]] + normals[first + tri[2]]) / 3.0f,
+                            it->material, lights, cameraPos));
+        }
+    }
+
+    bvh tree;
+    tree.build(points, triangles);
+
+    // How far off the surface shadow rays start
+    float offset = 0;
+    if (shadows && !points.empty())
+    {
+        Vector3 lo = points[0], hi = points[0];
+        for (unsigned v = 1; v < points.size(); v++)
+            for (int i = 0; i < 3; i++)
+            {
+                lo(i) = std::min(lo(i), points[v](i));
+                hi(i) = std::max(hi(i), points[v](i));
+            }
+        offset = SHADOW_OFFSET * (hi - lo).magnitude();
+    }
+
+    double end = statsClock();
+    if (stats)
+    {
+        stats->transform = end - start;
+        stats->triangles += triangles.size() / 3;
+    }
+    start = end;
+
+    // Rays start on the near plane and end on the far plane, which is t = 1
+    const Matrix4 ndcToWorld = viewProjectionMatrix.inverse();
+    const int xres = canv.getXRes(), yres = canv.getYRes();
+
+    // Traces the ray through the center of pixel (x, y) into sample, and
+    // returns whether it hit anything.  visible is room for every light.
+    auto tracePixel = [&](int x, int y, std::vector<float> &visible, traceSample &sample)
+    {
+        float ndcX = -1 + (x + 0.5f) * 2 / xres, ndcY = 1 - (y + 0.5f) * 2 / yres;
+        Vector4 nearPoint = ndcToWorld * makeVector4(ndcX, ndcY, -1.0f, 1.0f);
+        Vector4 farPoint = ndcToWorld * makeVector4(ndcX, ndcY, 1.0f, 1.0f);
+        nearPoint /= nearPoint(3);
+        farPoint /= farPoint(3);
+        float origin[3], dir[3];
+        for (int i = 0; i < 3; i++)
+        {
+            origin[i] = nearPoint(i);
+            dir[i] = farPoint(i) - nearPoint(i);
+        }
+
+        rayHit hit;
+        sample.hit = tree.intersect(origin, dir, 1, hit);
+        if (!sample.hit)
+            return false;
+
+        const int *tri = &triangles[3 * hit.triangle];
+        const Material &material = *materials[hit.triangle];
+        const float w0 = 1 - hit.u - hit.v;
+        const Vector3 pos = makeVector3(origin[0] + hit.t * dir[0], origin[1] + hit.t * dir[1],
+                origin[2] + hit.t * dir[2]);
+
+        if (shadows)
+        {
+            // Start just off the surface, on the side facing the
+            // camera, which is the side hit
+            const Vector3 e1 = points[tri[1]] - points[tri[0]];
+            const Vector3 e2 = points[tri[2]] - points[tri[0]];
+            Vector3 facing = makeVector3(e1(1) * e2(2) - e1(2) * e2(1),
+                    e1(2) * e2(0) - e1(0) * e2(2), e1(0) * e2(1) - e1(1) * e2(0));
+            facing.normalize();
+            float shadowOrigin[3], toLight[3];
+            for (int i = 0; i < 3; i++)
+                shadowOrigin[i] = pos(i) + offset * facing(i);
+            for (unsigned l = 0; l < lights.count; l++)
+            {
+                toLight[0] = lights.x[4 * l] - shadowOrigin[0];
+                toLight[1] = lights.y[4 * l] - shadowOrigin[1];
+                toLight[2] = lights.z[4 * l] - shadowOrigin[2];
+                visible[l] = tree.occluded(shadowOrigin, toLight, 1) ? 0.0f : 1.0f;
+            }
+        }
+
+        Vector3 color;
+        if (SHADING == PHONG)
+        {
+            Vector3 normal = normals[tri[0]] * w0 + normals[tri[1]] * hit.u + normals[tri[2]] * hit.v;
+            color = lightFunc<NUM_LIGHTS>(pos, normal, material, lights, cameraPos,
+                    shadows ? &visible[0] : NULL);
+        }
+        else if (!shadows)
+            color = SHADING == FLAT ? colors[hit.triangle] :
+                colors[tri[0]] * w0 + colors[tri[1]] * hit.u + colors[tri[2]] * hit.v;
+        else if (SHADING == FLAT)
+            color = lightFunc<NUM_LIGHTS>((points[tri[0]] + points[tri[1]] + points[tri[2]]) / 3.0f,
+                    (normals[tri[0]] + normals[tri[1]] + normals[tri[2]]) / 3.0f, material,
+                    lights, cameraPos, &visible[0]);
+        else
+        {
+            // The shadow falls across the triangle, so it can't be
+            // lit just at the vertices
+            color = makeVector3(0, 0, 0);
+            const float weight[3] = {w0, hit.u, hit.v};
+            for (int i = 0; i < 3; i++)
+                color += lightFunc<NUM_LIGHTS>(points[tri[i]], normals[tri[i]], material,
+                        lights, cameraPos, &visible[0]) * weight[i];
+        }
+
+        Vector4 ndc = viewProjectionMatrix * homogenize(pos);
+        sample.z = ndc(2) / ndc(3);
+        sample.color = color;
+        return true;
+    };
+
+    // Progressive passes trace every step'th pixel of every step'th row that
+    // the pass before didn't, and each sample is drawn over the step by step
+    // block of pixels it is the corner of.  Passes stop once the next one
+    // looks like it would miss the deadline, but the first always finishes.
+    const bool progressive = deadline > 0;
+    const int firstStep = progressive ? PROGRESSIVE_STEP : 1;
+    auto gridSize = [&](int step)
+    {
+        return static_cast<double>((xres + step - 1) / step) * ((yres + step - 1) / step);
+    };
+    std::vector<traceSample> samples(xres * yres);
+
+    // Squares of whole canvas tiles, so threads never share one
+    const int TRACE_SIZE = 2 * TILE_SIZE;
+    const int xsquares = (xres + TRACE_SIZE - 1) / TRACE_SIZE;
+    const int ysquares = (yres + TRACE_SIZE - 1) / TRACE_SIZE;
+    double traceTime = 0, perSample = 0, outputTime = 0;
+    for (int step = firstStep; step >= 1; step /= 2)
+    {
+        const double numSamples = gridSize(step) - (step < firstStep ? gridSize(2 * step) : 0);
+        if (step < firstStep && statsClock() + perSample * numSamples + outputTime > deadline)
+            break;
+
+        const double passStart = statsClock();
+        canv.clear();
+        parallelFor(xsquares * ysquares, numThreads, [&](unsigned square)
+        {
+            std::vector<float> visible(lights.count, 1.0f);
+            unsigned long long hits = 0;
+            const int x0 = square % xsquares * TRACE_SIZE, y0 = square / xsquares * TRACE_SIZE;
+            const int x1 = std::min(x0 + TRACE_SIZE, xres), y1 = std::min(y0 + TRACE_SIZE, yres);
+
+            // Squares reached after the deadline keep the last pass's samples
+            int drawStep = step;
+            if (step < firstStep && statsClock() > deadline)
+                drawStep = 2 * step;
+            else
+            {
+                for (int y = y0; y < y1; y += step)
+                    for (int x = x0; x < x1; x += step)
+                        if ((step == firstStep || x % (2 * step) || y % (2 * step)) &&
+                                tracePixel(x, y, visible, samples[y * xres + x]))
+                            hits++;
+            }
+
+            for (int y = y0; y < y1; y++)
+            {
+                for (int x = x0; x < x1; x++)
+                {
+                    const traceSample &sample = samples[(y - y % drawStep) * xres + x - x % drawStep];
+                    if (sample.hit)
+                        canv.drawPixel(x, y, sample.z, sample.color(0), sample.color(1), sample.color(2));
                 }
-                // Check for backface culling
-                // Z coordinate of cross product (v2 - v1) X (v0 - v1)
-                float z = (ndcCoords[2](0) - ndcCoords[1](0)) * (ndcCoords[0](1) - ndcCoords[1](1)) -
-                          (ndcCoords[0](0) - ndcCoords[1](0)) * (ndcCoords[2](1) - ndcCoords[1](1));
-                // If the triangle faces away.. don't draw
-                if (z <= 0)
-                    continue;
-
-                /*
-                std::cerr << "Drawing Triangle"
-                    << ": [" << ndcCoords[0](0) << ' ' << ndcCoords[0](1) << ' ' << ndcCoords[0](2)
-                    << "] - [" << ndcCoords[1](0) << ' ' << ndcCoords[1](1) << ' ' << ndcCoords[1](2)
-                    << "] - [" << ndcCoords[2](0) << ' ' << ndcCoords[2](1) << ' ' << ndcCoords[2](2) << "]\n";
-                    */
-
-
-                //std::cerr << "Normal Matrix?:\n" << normalMatrix;
-                // Now transform the normals
-                for (int i = 0; i < 3; i++)
+            }
+            if (stats)
+            {
+                stats->fragments += hits;
+                stats->shaded += hits;
+            }
+        });
+
+        const double passEnd = statsClock();
+        traceTime += passEnd - passStart;
+        perSample = (passEnd - passStart) / numSamples;
+        if (progressive)
+        {
+            passDone();
+            outputTime = statsClock() - passEnd;
+            if (statsClock() > deadline)
+                break;
+        }
+    }
+
+    if (stats)
+        stats->raster = traceTime;
+}
+
+
+// Returns true if the NDC triangle v0 v1 v2 faces the camera
+bool frontFacing(const Vector3 &v0, const Vector3 &v1, const Vector3 &v2)
+{
+    // Z coordinate of cross product (v2 - v1) X (v0 - v1)
+    float z = (v2(0) - v1(0)) * (v0(1) - v1(1)) -
+              (v0(0) - v1(0)) * (v2(1) - v1(1));
+    // If the triangle faces away.. don't draw
+    return z > 0;
+}
+
+/**
+ * Sorts the triangles into bins of whole canvas tiles, then rasterizes the
+ * bins in parallel.  Bins don't share any pixels or tiles, so the canvas
+ * needs no locking, and each bin draws its triangles in their original order,
+ * so every pixel ends up exactly as if drawn serially.  The bins are
+ * allocated from mem.
+ *
+ * With prepass each bin first draws all its triangles into the z buffer
+ * only, so that when they are shaded the early depth test in the rasterizer
+ * throws out everything but the nearest fragment of each pixel.  With gbuf
+ * phong shaded triangles only fill in the g-buffer.
+ */
+template<int SHADING, int NUM_LIGHTS>
+void render_binned(const binnedTriangle *triangles, Canvas &canv,
+        const lightBuffer &lights, const Vector3 &cameraPos, unsigned numThreads,
+        bool prepass, gBuffer *gbuf, arena &mem)
+{
+    const int BIN_SIZE = 8 * TILE_SIZE;
+    const int xbins = (canv.getXRes() + BIN_SIZE - 1) / BIN_SIZE;
+    const int ybins = (canv.getYRes() + BIN_SIZE - 1) / BIN_SIZE;
+
+    const unsigned numBins = xbins * ybins;
+
+    // Count each bin's triangles, so every bin can be allocated at its exact
+    // size, then fill them in a second pass
+    unsigned *binSize = mem.allocateArray<unsigned>(numBins);
+    std::fill(binSize, binSize + numBins, 0);
+    const binnedTriangle ***bins = NULL;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (const binnedTriangle *tri = triangles; tri; tri = tri->next)
+        {
+            // Pixels drawn are xStart <= x < xMax, yStart <= y < yMax
+            const triangleSetup &t = tri->setup;
+            for (int by = t.yStart / BIN_SIZE; by < ybins && by * BIN_SIZE < t.yMax; by++)
+                for (int bx = t.xStart / BIN_SIZE; bx < xbins && bx * BIN_SIZE < t.xMax; bx++)
                 {
-                    Vector4 norm = normalMatrix * homogenize(norms[i]);
-                    norm /= norm(3);
-                    // Use a shortcut to normalize
-                    norm(3) = 0; norm.normalize();
-                    norms[i] = makeVector3(norm(0), norm(1), norm(2));
+                    unsigned b = by * xbins + bx;
+                    if (pass == 0)
+                        binSize[b]++;
+                    else
+                        bins[b][binSize[b]++] = tri;
                 }
+        }
+        if (pass == 0)
+        {
+            bins = mem.allocateArray<const binnedTriangle **>(numBins);
+            for (unsigned b = 0; b < numBins; b++)
+            {
+                bins[b] = mem.allocateArray<const binnedTriangle *>(binSize[b]);
+                binSize[b] = 0;
+            }
+        }
+    }
 
-                Vector3 color;
-                // Calculate lighting once (FLAT)
-                if (shadingMode == FLAT)
-                    color = lightFunc((worldCoords[0] + worldCoords[1] + worldCoords[2])/3.0f,
-                            (norms[0] + norms[1] + norms[2]) / 3.0f, it->material, lights, cameraPos);
+    parallelFor(numBins, numThreads, [&](unsigned b)
+    {
+        int x0 = (b % xbins) * BIN_SIZE;
+        int y0 = (b / xbins) * BIN_SIZE;
+        for (unsigned i = 0; prepass && i < binSize[b]; i++)
+        {
+            const binnedTriangle &tri = *bins[b][i];
+            rasterizeQuads(tri.verts, tri.setup, depth_writer(canv),
+                    x0, y0, x0 + BIN_SIZE, y0 + BIN_SIZE);
+        }
+        for (unsigned i = 0; i < binSize[b]; i++)
+        {
+            const binnedTriangle &tri = *bins[b][i];
+            if (gbuf)
+                rasterizeQuads(tri.verts, tri.setup, gbuffer_writer(canv, *gbuf, *tri.material),
+                        x0, y0, x0 + BIN_SIZE, y0 + BIN_SIZE);
+            else if (SHADING == PHONG)
+                rasterizeQuads(tri.verts, tri.setup, phong_shader<NUM_LIGHTS>(canv, *tri.material, lights, cameraPos),
+                        x0, y0, x0 + BIN_SIZE, y0 + BIN_SIZE);
+            else
+                rasterizeQuads(tri.verts, tri.setup, simple_shader(canv),
+                        x0, y0, x0 + BIN_SIZE, y0 + BIN_SIZE);
+        }
+    });
+}
+
+/**
+ * The lighting pass of deferred shading: lights every pixel the geometry pass
+ * drew exactly once, four at a time with lightFunc4 where four pixels in a
+ * row share a material.  Rows are independent, so they are shared out
+ * between the threads.
+ */
+template<int NUM_LIGHTS>
+void shade_deferred(const gBuffer &gbuf, Canvas &canv, const lightBuffer &lights,
+        const Vector3 &cameraPos, unsigned numThreads)
+{
+    parallelFor(gbuf.yres, numThreads, [&](unsigned y)
+    {
+        for (int x = 0; x < gbuf.xres; x++)
+        {
+            int i = y * gbuf.xres + x;
+            const Material *material = gbuf.material[i];
+            if (!material)
+                continue;
 
-                vertex verts[3];
-                // Create vertices
-                for (int i = 0; i < 3; i++)
+            if (x + 3 < gbuf.xres && gbuf.material[i + 1] == material &&
+                    gbuf.material[i + 2] == material && gbuf.material[i + 3] == material)
+            {
+                // Gather the four pixels into lanes
+                __m128 pos[3], normal[3], color[3];
+                for (int c = 0; c < 3; c++)
                 {
-                    Vector3 worldCoord = worldCoords[i];
-                    Vector3 ndcCoord = ndcCoords[i];
-                    Vector3 normal = norms[i];
-
-                    // Calculate the lighting (GOURUAD)
-                    if (shadingMode == GOURAUD)
-                        color = lightFunc(worldCoord, normal, it->material, lights, cameraPos);
-
-                    // Then stuff the vertex structure
-                    // The data differs for flat/gouraud vs phong  see the
-                    // definitions of simple_shader and phong_shader
-                    const int NUM_DATA = 9;
-                    verts[i].num_data = NUM_DATA;
-                    verts[i].data = new float[NUM_DATA];
-                    verts[i].data[0] = ndcCoord(0);
-                    verts[i].data[1] = ndcCoord(1);
-                    verts[i].data[2] = ndcCoord(2);
-                    verts[i].data[3] = shadingMode == PHONG ? worldCoord(0) : color(0);
-                    verts[i].data[4] = shadingMode == PHONG ? worldCoord(1) : color(1);
-                    verts[i].data[5] = shadingMode == PHONG ? worldCoord(2) : color(2);
-                    verts[i].data[6] = normal(0);
-                    verts[i].data[7] = normal(1);
-                    verts[i].data[8] = normal(2);
+                    pos[c] = _mm_setr_ps(gbuf.world[3 * i + c], gbuf.world[3 * i + 3 + c],
+                            gbuf.world[3 * i + 6 + c], gbuf.world[3 * i + 9 + c]);
+                    normal[c] = _mm_setr_ps(gbuf.normal[3 * i + c], gbuf.normal[3 * i + 3 + c],
+                            gbuf.normal[3 * i + 6 + c], gbuf.normal[3 * i + 9 + c]);
                 }
+                lightFunc4<NUM_LIGHTS>(pos, normal, *material, lights, cameraPos, color);
+
+                float r[4], g[4], b[4];
+                _mm_storeu_ps(r, color[0]);
+                _mm_storeu_ps(g, color[1]);
+                _mm_storeu_ps(b, color[2]);
+                for (int l = 0; l < 4; l++)
+                    canv.drawPixel(x + l, y, r[l], g[l], b[l]);
+                x += 3;
+                continue;
+            }
+
+            const float *world = gbuf.world + 3 * i, *normal = gbuf.normal + 3 * i;
+            Vector3 color = lightFunc<NUM_LIGHTS>(makeVector3(world[0], world[1], world[2]),
+                    makeVector3(normal[0], normal[1], normal[2]), *gbuf.material[i], lights, cameraPos);
+            canv.drawPixel(x, y, color(0), color(1), color(2));
+        }
+    });
+}
+
+/**
+ * Fills in the separator's object space bounding box, and a bounding sphere
+ * around the box's center.
+ */
+void compute_bounds(Separator &sep)
+{
+    sep.boxMin = sep.boxMax = sep.sphereCenter = makeVector3(0, 0, 0);
+    sep.sphereRadius = 0;
+    if (sep.points.empty())
+        return;
+
+    sep.boxMin = sep.boxMax = sep.points[0];
+    for (unsigned i = 1; i < sep.points.size(); i++)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            sep.boxMin(c) = std::min(sep.boxMin(c), sep.points[i](c));
+            sep.boxMax(c) = std::max(sep.boxMax(c), sep.points[i](c));
+        }
+    }
+
+    sep.sphereCenter = (sep.boxMin + sep.boxMax) / 2.0f;
+    for (unsigned i = 0; i < sep.points.size(); i++)
+        sep.sphereRadius = std::max(sep.sphereRadius, (sep.points[i] - sep.sphereCenter).magnitude());
+}
+
+/**
+ * Returns true if none of the separator can be seen through objectToClip,
+ * the transform from its object space to clip space.  The bounding sphere is
+ * tested against the frustum's planes first, and if that doesn't settle it
+ * the bounding box's corners are.  It only ever errs towards drawing.
+ */
+bool outside_frustum(const Separator &sep, const Matrix4 &objectToClip)
+{
+    if (sep.points.empty())
+        return true;
+
+    // The frustum's planes in object space are w + x >= 0, w - x >= 0 and so
+    // on for y and z, which are sums of rows of objectToClip
+    const Matrix4 &m = objectToClip;
+    const Vector3 &center = sep.sphereCenter;
+    for (int p = 0; p < 6; p++)
+    {
+        int row = p / 2;
+        float sign = (p & 1) ? -1 : 1;
+        float a = m(3, 0) + sign * m(row, 0);
+        float b = m(3, 1) + sign * m(row, 1);
+        float c = m(3, 2) + sign * m(row, 2);
+        float d = m(3, 3) + sign * m(row, 3);
+        float dist = a * center(0) + b * center(1) + c * center(2) + d;
+        if (dist < -sep.sphereRadius * sqrtf(a * a + b * b + c * c))
+            return true;
+    }
+
+    // Outside if every corner of the box is outside the same plane
+    int outside = OUT_FRUSTUM;
+    for (int i = 0; i < 8 && outside; i++)
+    {
+        Vector4 corner = m * makeVector4((i & 1) ? sep.boxMax(0) : sep.boxMin(0),
+                (i & 2) ? sep.boxMax(1) : sep.boxMin(1),
+                (i & 4) ? sep.boxMax(2) : sep.boxMin(2), 1);
+        outside &= outcode(corner);
+    }
+    return outside != 0;
+}
+
+/**
+ * Returns the outcode of a clip space position, see OUT_LEFT and friends.
+ */
+int outcode(const Vector4 &clip)
+{
+    float x = clip(0), y = clip(1), z = clip(2), w = clip(3);
+    int code = 0;
+    if (x < -w) code |= OUT_LEFT;
+    if (x > w) code |= OUT_RIGHT;
+    if (y < -w) code |= OUT_BOTTOM;
+    if (y > w) code |= OUT_TOP;
+    if (z < -w) code |= OUT_NEAR;
+    if (z > w) code |= OUT_FAR;
+    if (x < -GUARD_BAND * w) code |= OUT_GUARD_LEFT;
+    if (x > GUARD_BAND * w) code |= OUT_GUARD_RIGHT;
+    if (y < -GUARD_BAND * w) code |= OUT_GUARD_BOTTOM;
+    if (y > GUARD_BAND * w) code |= OUT_GUARD_TOP;
+    return code;
+}
+
+/**
+ * Sutherland-Hodgman clips the convex polygon of clip space positions pos
+ * and vertices verts, n of each, against the planes set in the outcode bits
+ * planes.  Clipping is done before the divide by w, so the polygon can cross
+ * w = 0.  New vertices get their data (past the position in data[0-2])
+ * interpolated linearly.  The result replaces the input, and its vertex
+ * count is returned; under 3 means nothing is left.
+ */
+int clip_polygon(Vector4 pos[MAX_CLIP_VERTS], vertex verts[MAX_CLIP_VERTS], int n, int planes)
+{
+    const int CLIP_PLANES[] = {OUT_NEAR, OUT_FAR, OUT_GUARD_LEFT, OUT_GUARD_RIGHT,
+        OUT_GUARD_BOTTOM, OUT_GUARD_TOP};
+    for (unsigned p = 0; p < sizeof(CLIP_PLANES) / sizeof(CLIP_PLANES[0]) && n >= 3; p++)
+    {
+        if (!(planes & CLIP_PLANES[p]))
+            continue;
 
-                // RASTERIZE GO
-                if (shadingMode == PHONG)
-                    rasterizeTriangle(verts, phong_shader(canv, it->material, lights, cameraPos));
-                else
-                    rasterizeTriangle(verts, simple_shader(canv));
+        // Signed distance of each vertex from the plane, inside is positive
+        float dist[MAX_CLIP_VERTS];
+        for (int i = 0; i < n; i++)
+        {
+            float x = pos[i](0), y = pos[i](1), z = pos[i](2), w = pos[i](3);
+            switch (CLIP_PLANES[p])
+            {
+                case OUT_NEAR: dist[i] = w + z; break;
+                case OUT_FAR: dist[i] = w - z; break;
+                case OUT_GUARD_LEFT: dist[i] = GUARD_BAND * w + x; break;
+                case OUT_GUARD_RIGHT: dist[i] = GUARD_BAND * w - x; break;
+                case OUT_GUARD_BOTTOM: dist[i] = GUARD_BAND * w + y; break;
+                case OUT_GUARD_TOP: dist[i] = GUARD_BAND * w - y; break;
+            }
+        }
 
-                // clean up
-                for (int i = 0; i < 3; i++)
-                    delete[] verts[i].data;
+        Vector4 outPos[MAX_CLIP_VERTS];
+        vertex outVerts[MAX_CLIP_VERTS];
+        int out = 0;
+        for (int i = 0; i < n; i++)
+        {
+            int j = (i + 1) % n;
+            if (dist[i] >= 0)
+            {
+                outPos[out] = pos[i];
+                outVerts[out++] = verts[i];
+            }
+            // The edge crosses the plane, add the crossing point
+            if ((dist[i] >= 0) != (dist[j] >= 0))
+            {
+                float t = dist[i] / (dist[i] - dist[j]);
+                outPos[out] = pos[i] + (pos[j] - pos[i]) * t;
+                vertex &v = outVerts[out++];
+                v.num_data = verts[i].num_data;
+                for (unsigned d = 3; d < v.num_data; d++)
+                    v.data[d] = verts[i].data[d] + (verts[j].data[d] - verts[i].data[d]) * t;
             }
         }
+
+        n = out;
+        std::copy(outPos, outPos + n, pos);
+        std::copy(outVerts, outVerts + n, verts);
     }
+    return n;
 }
 
 Matrix4 getCameraTransform(const Scene &scene)
@@ -384,31 +1532,155 @@ void print_scene_info(const Scene &scene)
     }
 }
 
+/**
+ * Lights a point with every light.  With NUM_LIGHTS more than 0, lights must
+ * have exactly that many lights, and the loop over them is unrolled at
+ * compile time.  This is lightFunc4 with the point in every lane, so single
+ * points and quads are always lit exactly the same.
+ */
+template<int NUM_LIGHTS>
 Vector3 lightFunc(const Vector3 &pos, const Vector3 &normal, const Material &material,
-        const std::vector<Light>& lights, const Vector3 &camerapos)
+        const lightBuffer &lights, const Vector3 &camerapos, const float *visible)
+{
+    __m128 pos4[3], normal4[3], color[3];
+    for (int j = 0; j < 3; j++)
+    {
+        pos4[j] = _mm_set1_ps(pos(j));
+        normal4[j] = _mm_set1_ps(normal(j));
+    }
+    lightFunc4<NUM_LIGHTS>(pos4, normal4, material, lights, camerapos, color, visible);
+
+    return makeVector3(_mm_cvtss_f32(color[0]), _mm_cvtss_f32(color[1]), _mm_cvtss_f32(color[2]));
+}
+
+// Helpers for lightFunc4, each __m128[3] is a vector for four pixels.
+static inline __m128 dot4(const __m128 a[3], const __m128 b[3])
+{
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])),
+            _mm_mul_ps(a[2], b[2]));
+}
+
+static inline void normalize4(__m128 v[3])
+{
+    __m128 mag = _mm_sqrt_ps(dot4(v, v));
+    for (int i = 0; i < 3; i++)
+        v[i] = _mm_div_ps(v[i], mag);
+}
+
+// a where mask is set, b elsewhere
+static inline __m128 select4(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+/**
+ * k to the power e for four k in [0, 1] and e >= 0, as 2^(e log2 k) with
+ * polynomials for log2 and 2^x.  The series are cut off below float
+ * precision; measured against double pow the error stays under 3e-7 for
+ * exponents from 0.2 to 128, far below a color step.  Results below 2^-126
+ * flush to 0, as does 0 to any positive power.
+ */
+static inline __m128 pow4(__m128 k, float e)
 {
-    Vector3 diffuse, specular;
-    //std::cerr << "Lighting Position: [" << pos(0) << ' ' << pos(1) << ' ' << pos(2) << "]\n";
+    const __m128 one = _mm_set1_ps(1);
+    if (e == 0)
+        return one;
 
-    for (unsigned i = 0; i < lights.size(); i++)
+    // k = m 2^exponent, with m in [sqrt(1/2), sqrt(2))
+    __m128i bits = _mm_castps_si128(k);
+    __m128i exponent = _mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127));
+    __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x7FFFFF)),
+                _mm_set1_epi32(0x3F800000)));
+    __m128 big = _mm_cmpgt_ps(m, _mm_set1_ps(1.41421356f));
+    m = select4(big, _mm_mul_ps(m, _mm_set1_ps(0.5f)), m);
+    exponent = _mm_sub_epi32(exponent, _mm_castps_si128(big)); // big is -1
+
+    // log2 m = 2 / ln 2 * atanh t, t = (m - 1) / (m + 1), |t| < 0.172
+    __m128 t = _mm_div_ps(_mm_sub_ps(m, one), _mm_add_ps(m, one));
+    __m128 t2 = _mm_mul_ps(t, t);
+    __m128 series = _mm_add_ps(_mm_set1_ps(1.0f / 7), _mm_mul_ps(t2, _mm_set1_ps(1.0f / 9)));
+    series = _mm_add_ps(_mm_set1_ps(1.0f / 5), _mm_mul_ps(t2, series));
+    series = _mm_add_ps(_mm_set1_ps(1.0f / 3), _mm_mul_ps(t2, series));
+    series = _mm_add_ps(one, _mm_mul_ps(t2, series));
+    __m128 log2k = _mm_add_ps(_mm_cvtepi32_ps(exponent),
+            _mm_mul_ps(_mm_mul_ps(t, series), _mm_set1_ps(2.88539008f)));
+
+    // 2^y = 2^i e^(f ln 2), y = i + f with |f| <= 1/2
+    __m128 y = _mm_mul_ps(log2k, _mm_set1_ps(e));
+    __m128 underflow = _mm_or_ps(_mm_cmplt_ps(y, _mm_set1_ps(-126)),
+            _mm_cmplt_ps(k, _mm_set1_ps(1.17549435e-38f)));
+    y = _mm_min_ps(_mm_max_ps(y, _mm_set1_ps(-126)), _mm_set1_ps(127));
+    __m128i i = _mm_cvtps_epi32(y);
+    __m128 c = _mm_mul_ps(_mm_sub_ps(y, _mm_cvtepi32_ps(i)), _mm_set1_ps(0.693147181f));
+    __m128 ec = _mm_add_ps(_mm_set1_ps(1.0f / 120), _mm_mul_ps(c, _mm_set1_ps(1.0f / 720)));
+    ec = _mm_add_ps(_mm_set1_ps(1.0f / 24), _mm_mul_ps(c, ec));
+    ec = _mm_add_ps(_mm_set1_ps(1.0f / 6), _mm_mul_ps(c, ec));
+    ec = _mm_add_ps(_mm_set1_ps(0.5f), _mm_mul_ps(c, ec));
+    ec = _mm_add_ps(one, _mm_mul_ps(c, ec));
+    ec = _mm_add_ps(one, _mm_mul_ps(c, ec));
+    __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23));
+
+    return _mm_andnot_ps(underflow, _mm_mul_ps(ec, scale));
+}
+
+/**
+ * Four pixel version of lightFunc.  pos and normal hold the x, y and z of
+ * each pixel's position and normal, the lit colors are put in color.
+ * NUM_LIGHTS and visible are as for lightFunc, with visible the same for
+ * all four.
+ */
+template<int NUM_LIGHTS>
+void lightFunc4(const __m128 pos[3], const __m128 normal[3], const Material &material,
+        const lightBuffer &lights, const Vector3 &camerapos, __m128 color[3],
+        const float *visible)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1);
+    __m128 diffuse[3] = {zero, zero, zero};
+    __m128 specular[3] = {zero, zero, zero};
+
+    // Direction to the camera doesn't depend on the light
+    __m128 toCamera[3];
+    for (int j = 0; j < 3; j++)
+        toCamera[j] = _mm_sub_ps(_mm_set1_ps(camerapos(j)), pos[j]);
+    normalize4(toCamera);
+
+    const unsigned numLights = NUM_LIGHTS ? NUM_LIGHTS : lights.count;
+    for (unsigned i = 0; i < numLights; i++)
     {
+        __m128 toLight[3] = {_mm_sub_ps(lights.load(lights.x, i), pos[0]),
+            _mm_sub_ps(lights.load(lights.y, i), pos[1]), _mm_sub_ps(lights.load(lights.z, i), pos[2])};
+        __m128 lightColor[3] = {lights.load(lights.r, i), lights.load(lights.g, i),
+            lights.load(lights.b, i)};
+        if (visible)
+            for (int j = 0; j < 3; j++)
+                lightColor[j] = _mm_mul_ps(lightColor[j], _mm_set1_ps(visible[i]));
+        __m128 halfway[3];
+        normalize4(toLight);
+
         // Calculate the diffuse contribution
-        float NdotL = (normal.dot((lights[i].position - pos).normalize()));
-        Vector3 ddiffuse = lights[i].color * NdotL;
-        ddiffuse.clamp(0, HUGE_VAL);
-        diffuse += ddiffuse;
+        __m128 NdotL = dot4(normal, toLight);
 
         // Calculate the specular contribution
-        float k = normal.dot(((camerapos - pos).normalize() + (lights[i].position - pos).normalize()).normalize());
-        k = k > 0 ? k : 0; // zeroclip
-        Vector3 dspecular = lights[i].color * powf(k, material.shininess);
-        dspecular.clamp(0, HUGE_VAL);
-        specular += dspecular;
-    }
+        for (int j = 0; j < 3; j++)
+            halfway[j] = _mm_add_ps(toCamera[j], toLight[j]);
+        normalize4(halfway);
+        __m128 k = _mm_min_ps(_mm_max_ps(dot4(normal, halfway), zero), one); // zeroclip
+        __m128 kpow = pow4(k, material.shininess);
 
-    diffuse.clamp(0, 1);
-    Vector3 color = material.ambientColor + (diffuse ^ material.diffuseColor) + (specular ^ material.specularColor);
-    color.clamp(0, 1);
+        for (int j = 0; j < 3; j++)
+        {
+            diffuse[j] = _mm_add_ps(diffuse[j], _mm_max_ps(_mm_mul_ps(lightColor[j], NdotL), zero));
+            specular[j] = _mm_add_ps(specular[j], _mm_max_ps(_mm_mul_ps(lightColor[j], kpow), zero));
+        }
+    }
 
-    return color;
+    for (int j = 0; j < 3; j++)
+    {
+        diffuse[j] = _mm_min_ps(diffuse[j], one);
+        color[j] = _mm_add_ps(_mm_add_ps(_mm_set1_ps(material.ambientColor(j)),
+                    _mm_mul_ps(diffuse[j], _mm_set1_ps(material.diffuseColor(j)))),
+                _mm_mul_ps(specular[j], _mm_set1_ps(material.specularColor(j))));
+        color[j] = _mm_min_ps(_mm_max_ps(color[j], zero), one);
+    }
 }
@@ -0,0 +1,106 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <sys/resource.h>
+
+/**
+ * What a render did and how long each part took, for the -stats option.
+ * Counters can be bumped from several threads at once.  Whatever a program
+ * doesn't do stays 0.
+ */
+struct renderStats
+{
+    renderStats() :
+        parse(0), transform(0), raster(0), deferredShading(0), output(0),
+        triangles(0), frustumCulled(0), backfaceCulled(0), degenerate(0), lines(0),
+        fragments(0), depthRejected(0), shaded(0),
+        pixels(0)
+    {}
+
+    // Wall time of each phase, in seconds
+    double parse;
+    double transform;
+    double raster;
+    // Only the lighting pass of deferred shading; forward shading happens as
+    // fragments are rasterized, so it counts as raster
+    double deferredShading;
+    double output;
+
+    // Primitives submitted, and thrown out before rasterizing
+    std::atomic<unsigned long long> triangles;
+    std::atomic<unsigned long long> frustumCulled;
+    std::atomic<unsigned long long> backfaceCulled;
+    std::atomic<unsigned long long> degenerate;
+    std::atomic<unsigned long long> lines;
+
+    // Pixels primitives covered, those that failed the depth test, and those
+    // that were drawn
+    std::atomic<unsigned long long> fragments;
+    std::atomic<unsigned long long> depthRejected;
+    std::atomic<unsigned long long> shaded;
+
+    // Distinct pixels drawn in the final image, or images
+    std::atomic<unsigned long long> pixels;
+
+    // Fragments drawn per pixel drawn
+    double overdraw() const
+    {
+        return pixels ? static_cast<double>(shaded) / pixels : 0;
+    }
+
+    // Largest resident set size so far, in kilobytes
+    static long peakMemory()
+    {
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+
+    void print(std::ostream &os) const
+    {
+        os << "parse        " << parse << " s\n"
+           << "transform    " << transform << " s\n"
+           << "raster       " << raster << " s\n"
+           << "deferred     " << deferredShading << " s\n"
+           << "output       " << output << " s\n"
+           << "triangles    " << triangles << " submitted, " << frustumCulled << " outside the frustum, "
+           << backfaceCulled << " backface culled, " << degenerate << " degenerate\n"
+           << "lines        " << lines << " submitted\n"
+           << "fragments    " << fragments << " generated, " << depthRejected << " depth rejected, "
+           << shaded << " drawn\n"
+           << "overdraw     " << overdraw() << " (" << pixels << " pixels)\n"
+           << "peak memory  " << peakMemory() << " KB\n";
+    }
+
+    void printJSON(std::ostream &os) const
+    {
+        os << "{\"parse\": " << parse
+           << ", \"transform\": " << transform
+           << ", \"raster\": " << raster
+           << ", \"deferredShading\": " << deferredShading
+           << ", \"output\": " << output
+           << ", \"triangles\": " << triangles
+           << ", \"frustumCulled\": " << frustumCulled
+           << ", \"backfaceCulled\": " << backfaceCulled
+           << ", \"degenerate\": " << degenerate
+           << ", \"lines\": " << lines
+           << ", \"fragments\": " << fragments
+           << ", \"depthRejected\": " << depthRejected
+           << ", \"shaded\": " << shaded
+           << ", \"pixels\": " << pixels
+           << ", \"overdraw\": " << overdraw()
+           << ", \"peakMemoryKB\": " << peakMemory()
+           << "}\n";
+    }
+};
+
+// Seconds since some fixed point, for timing phases
+inline double statsClock()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The stats being collected, or NULL when they aren't.  Defined next to
+// main.
+extern renderStats *stats;
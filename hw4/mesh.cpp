@@ -0,0 +1,186 @@
+#include <vector>
+#include <unordered_map>
+#include "parser.h"
+
+// Vertices a typical post transform cache holds, what triangles are ordered
+// for
+static const int MESH_CACHE_SIZE = 16;
+
+/**
+ * Orders triangles (three vertex indices each, over numVertices vertices) so
+ * that consecutive triangles share vertices while they are still in a FIFO
+ * cache of cacheSize vertices.  This is Tipsify, from Sander, Nehab and
+ * Barczak, "Fast Triangle Reordering for Vertex Locality and Reduced
+ * Overdraw": fan out around one vertex at a time, and move on to the
+ * neighbour that will still be in the cache once its triangles are done.
+ */
+std::vector<int> tipsify(const std::vector<int> &triangles, int numVertices, int cacheSize)
+{
+    // Nothing to order, and nowhere to start fanning from
+    if (triangles.empty() || numVertices == 0)
+        return triangles;
+
+    int numTriangles = triangles.size() / 3;
+
+    // Triangles using each vertex, adjacency[offsets[v]] onwards
+    std::vector<int> live(numVertices, 0);
+    for (unsigned i = 0; i < triangles.size(); i++)
+        live[triangles[i]]++;
+    std::vector<int> offsets(numVertices + 1, 0);
+    for (int v = 0; v < numVertices; v++)
+        offsets[v + 1] = offsets[v] + live[v];
+    std::vector<int> adjacency(triangles.size());
+    std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+    for (int t = 0; t < numTriangles; t++)
+        for (int c = 0; c < 3; c++)
+            adjacency[fill[triangles[3*t + c]]++] = t;
+
+    // When each vertex last went into the cache
+    std::vector<int> cacheTime(numVertices, 0);
+    std::vector<bool> emitted(numTriangles, false);
+    // Recently used vertices, to pick up from when a fan runs out
+    std::vector<int> deadEnd;
+    std::vector<int> candidates;
+    std::vector<int> order;
+    order.reserve(triangles.size());
+
+    int fanning = 0;
+    int time = cacheSize + 1;
+    int cursor = 0;
+    while (fanning >= 0)
+    {
+        candidates.clear();
+        for (int a = offsets[fanning]; a < offsets[fanning + 1]; a++)
+        {
+            int t = adjacency[a];
+            if (emitted[t])
+                continue;
+            for (int c = 0; c < 3; c++)
+            {
+                int v = triangles[3*t + c];
+                order.push_back(v);
+                deadEnd.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if (time - cacheTime[v] > cacheSize)
+                    cacheTime[v] = time++;
+            }
+            emitted[t] = true;
+        }
+
+        // Next, the candidate that will still be cached after fanning
+        // around it, and of those the one that went in first
+        fanning = -1;
+        int best = -1;
+        for (unsigned i = 0; i < candidates.size(); i++)
+        {
+            int v = candidates[i];
+            if (live[v] <= 0)
+                continue;
+            int priority = 0;
+            if (time - cacheTime[v] + 2 * live[v] <= cacheSize)
+                priority = time - cacheTime[v];
+            if (priority > best)
+            {
+                best = priority;
+                fanning = v;
+            }
+        }
+
+        // Nothing nearby has triangles left, so go back to a recent vertex
+        // that does, or failing that any vertex that does
+        while (fanning < 0 && !deadEnd.empty())
+        {
+            int v = deadEnd.back();
+            deadEnd.pop_back();
+            if (live[v] > 0)
+                fanning = v;
+        }
+        for (; fanning < 0 && cursor < numVertices; cursor++)
+            if (live[cursor] > 0)
+                fanning = cursor;
+    }
+
+    return order;
+}
+
+/**
+ * Reorders mesh's triangles for the post transform vertex cache (tipsify),
+ * then renumbers its vertices in the order triangles first use them, so they
+ * are fetched nearly sequentially.  Vertices no triangle uses are dropped.
+ */
+void optimize_mesh(Mesh &mesh)
+{
+    std::vector<Vector3> points, normals;
+    points.swap(mesh.points);
+    normals.swap(mesh.normals);
+    mesh.triangles = tipsify(mesh.triangles, points.size(), MESH_CACHE_SIZE);
+
+    // Renumber by first use
+    std::vector<int> renumber(points.size(), -1);
+    for (unsigned i = 0; i < mesh.triangles.size(); i++)
+    {
+        int &v = mesh.triangles[i];
+        if (renumber[v] == -1)
+        {
+            renumber[v] = mesh.points.size();
+            mesh.points.push_back(points[v]);
+            mesh.normals.push_back(normals[v]);
+        }
+        v = renumber[v];
+    }
+}
+
+/**
+ * Fills in sep.mesh from the separator's faces.  Faces are fan triangulated
+ * the same way they would be drawn, each distinct (point, normal) index pair
+ * becomes one vertex, and the result is ordered by optimize_mesh.
+ */
+void build_mesh(Separator &sep)
+{
+    Mesh &mesh = sep.mesh;
+    const std::vector<int> &indices = sep.indices;
+    const std::vector<int> &normindices = sep.normalindices;
+
+    // Weld, key is the index pair packed into 64 bits
+    std::unordered_map<unsigned long long, int> welded;
+    mesh.points.clear();
+    mesh.normals.clear();
+    mesh.triangles.clear();
+    mesh.error = 0;
+    int first = -1, prev = -1;
+    for (unsigned i = 0; i < indices.size(); i++)
+    {
+        // ending index -> reset
+        if (indices[i] == -1)
+        {
+            first = prev = -1;
+            continue;
+        }
+
+        unsigned long long key = (static_cast<unsigned long long>(indices[i]) << 32) |
+            static_cast<unsigned>(normindices[i]);
+        std::pair<std::unordered_map<unsigned long long, int>::iterator, bool> found =
+            welded.insert(std::make_pair(key, static_cast<int>(mesh.points.size())));
+        if (found.second)
+        {
+            mesh.points.push_back(sep.points[indices[i]]);
+            mesh.normals.push_back(sep.normals[normindices[i]]);
+        }
+        int v = found.first->second;
+
+        if (first == -1)
+            first = v;
+        else if (prev == -1)
+            prev = v;
+        else
+        {
+            mesh.triangles.push_back(first);
+            mesh.triangles.push_back(prev);
+            mesh.triangles.push_back(v);
+            prev = v;
+        }
+    }
+
+    optimize_mesh(mesh);
+}
@@ -1,13 +1,18 @@
 #include <iostream>
+#include <algorithm>
+#include <cmath>
 #include "GL/gl.h"
 #include "GL/glut.h"
 #include "parser.h"
 #include "transforms.h" 
-void parse_file(std::istream &input, Scene *output);
+void read_scene(std::istream &input, int fd, Scene *output);
 
 // Our scene
 Scene scene;
 bool wireframe;
+// Whether separators are drawn from their simplified meshes when those are
+// close enough, see LOD_PIXELS
+bool lods;
 bool translating, zooming, rotating;
 int mouseX, mouseY;
 
@@ -15,6 +20,20 @@ Vector3 mouseTrans;
 Matrix4 mouseRot;
 float mouseZoom;
 
+// Outcode bits of a clip space position, set for each plane of the view
+// frustum it is outside of
+static const int OUT_LEFT = 1;
+static const int OUT_RIGHT = 2;
+static const int OUT_BOTTOM = 4;
+static const int OUT_TOP = 8;
+static const int OUT_NEAR = 16;
+static const int OUT_FAR = 32;
+static const int OUT_FRUSTUM = OUT_LEFT | OUT_RIGHT | OUT_BOTTOM | OUT_TOP | OUT_NEAR | OUT_FAR;
+
+// How many pixels off a separator's simplified mesh may look before its
+// full mesh is drawn instead
+static const float LOD_PIXELS = 1;
+
 /** PROTOTYPES **/
 void initLights();
 void initMaterial(const Material &mat);
@@ -22,6 +41,12 @@ void redraw();
 void initGL();
 void resize(GLint w, GLint h);
 void keyfunc(GLubyte key, GLint x, GLint y);
+void compute_bounds(Separator &sep);
+void build_mesh(Separator &sep);
+void build_lods(Separator &sep);
+const Mesh &select_lod(const Separator &sep, const Matrix4 &objectToClip, int xRes, int yRes,
+        float maxPixels);
+bool outside_frustum(const Separator &sep, const Matrix4 &objectToClip);
 
 /** GLUT callback functions **/
 
@@ -51,12 +76,14 @@ void redraw()
 
     glMultMatrixf(oldMatrix);
 
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
    
     
     for (unsigned i = 0; i < scene.separators.size(); i++)
     {
         const Separator &sep = scene.separators[i];
-        initMaterial(sep.material);
         glPushMatrix();
 
         for (unsigned j = 0; j < sep.transforms.size(); j++)
@@ -67,7 +94,36 @@ void redraw()
             glScalef(trans.scaling(0), trans.scaling(1), trans.scaling(2));
         }
 
-        GLenum renderType = wireframe ? GL_LINE_LOOP : GL_POLYGON;
+        // Don't send separators that are entirely off screen to OpenGL at
+        // all.  OpenGL's matrices are column major.
+        Matrix4 modelView, projection;
+        glGetFloatv(GL_MODELVIEW_MATRIX, &modelView(0));
+        glGetFloatv(GL_PROJECTION_MATRIX, &projection(0));
+        const Matrix4 objectToClip = (modelView * projection).transpose();
+        if (outside_frustum(sep, objectToClip))
+        {
+            glPopMatrix();
+            continue;
+        }
+        initMaterial(sep.material);
+
+        if (!wireframe)
+        {
+            // Filled, the whole separator goes in one call from its mesh,
+            // which shares vertices between triangles.  Far away, a simpler
+            // mesh looks the same.
+            const Mesh &mesh = select_lod(sep, objectToClip, viewport[2], viewport[3], lods ? LOD_PIXELS : 0);
+            if (!mesh.triangles.empty())
+            {
+                glVertexPointer(3, GL_FLOAT, sizeof(Vector3), &mesh.points[0](0));
+                glNormalPointer(GL_FLOAT, sizeof(Vector3), &mesh.normals[0](0));
+                glDrawElements(GL_TRIANGLES, mesh.triangles.size(), GL_UNSIGNED_INT, &mesh.triangles[0]);
+            }
+            glPopMatrix();
+            continue;
+        }
+
+        GLenum renderType = GL_LINE_LOOP;
 
         glBegin(renderType);
         for (unsigned j = 0; j < sep.indices.size(); j++)
@@ -134,6 +190,11 @@ void keyfunc(GLubyte key, GLint x, GLint y)
         wireframe = !wireframe;
         glutPostRedisplay();
     }
+    if (key == 'l' || key == 'L')
+    {
+        lods = !lods;
+        glutPostRedisplay();
+    }
     if (key == 'f' || key == 'F')
     {
         glShadeModel(GL_FLAT);
@@ -199,6 +260,75 @@ void motionfunc(int x, int y)
 
 /** Utility functions **/
 
+/**
+ * Fills in the separator's object space bounding box, and a bounding sphere
+ * around the box's center.
+ */
+void compute_bounds(Separator &sep)
+{
+    sep.boxMin = sep.boxMax = sep.sphereCenter = makeVector3(0, 0, 0);
+    sep.sphereRadius = 0;
+    if (sep.points.empty())
+        return;
+
+    sep.boxMin = sep.boxMax = sep.points[0];
+    for (unsigned i = 1; i < sep.points.size(); i++)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            sep.boxMin(c) = std::min(sep.boxMin(c), sep.points[i](c));
+            sep.boxMax(c) = std::max(sep.boxMax(c), sep.points[i](c));
+        }
+    }
+
+    sep.sphereCenter = (sep.boxMin + sep.boxMax) / 2.0f;
+    for (unsigned i = 0; i < sep.points.size(); i++)
+        sep.sphereRadius = std::max(sep.sphereRadius, (sep.points[i] - sep.sphereCenter).magnitude());
+}
+
+/**
+ * Returns true if none of the separator can be seen through objectToClip,
+ * the transform from its object space to clip space.  The bounding sphere is
+ * tested against the frustum's planes first, and if that doesn't settle it
+ * the bounding box's corners are.  It only ever errs towards drawing.
+ */
+bool outside_frustum(const Separator &sep, const Matrix4 &objectToClip)
+{
+    if (sep.points.empty())
+        return true;
+
+    // The frustum's planes in object space are w + x >= 0, w - x >= 0 and so
+    // on for y and z, which are sums of rows of objectToClip
+    const Matrix4 &m = objectToClip;
+    const Vector3 &center = sep.sphereCenter;
+    for (int p = 0; p < 6; p++)
+    {
+        int row = p / 2;
+        float sign = (p & 1) ? -1 : 1;
+        float a = m(3, 0) + sign * m(row, 0);
+        float b = m(3, 1) + sign * m(row, 1);
+        float c = m(3, 2) + sign * m(row, 2);
+        float d = m(3, 3) + sign * m(row, 3);
+        float dist = a * center(0) + b * center(1) + c * center(2) + d;
+        if (dist < -sep.sphereRadius * sqrtf(a * a + b * b + c * c))
+            return true;
+    }
+
+    // Outside if every corner of the box is outside the same plane
+    int outside = OUT_FRUSTUM;
+    for (int i = 0; i < 8 && outside; i++)
+    {
+        Vector4 corner = m * makeVector4((i & 1) ? sep.boxMax(0) : sep.boxMin(0),
+                (i & 2) ? sep.boxMax(1) : sep.boxMin(1),
+                (i & 4) ? sep.boxMax(2) : sep.boxMin(2), 1);
+        float x = corner(0), y = corner(1), z = corner(2), w = corner(3);
+        outside &= (x < -w ? OUT_LEFT : 0) | (x > w ? OUT_RIGHT : 0) |
+            (y < -w ? OUT_BOTTOM : 0) | (y > w ? OUT_TOP : 0) |
+            (z < -w ? OUT_NEAR : 0) | (z > w ? OUT_FAR : 0);
+    }
+    return outside != 0;
+}
+
 /**
  * Sets up an OpenGL light.  This only needs to be called once
  * and the light will be used during all renders.
@@ -260,6 +390,10 @@ void initGL()
     // Enable depth-buffer test.
     glEnable(GL_DEPTH_TEST);
 
+    // Filled separators are drawn from vertex and normal arrays
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+
     const Camera& cam = scene.camera;
     
     // Set up projection and modelview matrices ("camera" settings) 
@@ -279,6 +413,7 @@ void initGL()
     initLights();
 
     wireframe = false;
+    lods = true;
     mouseTrans = makeVector3(0, 0, 0);
     mouseZoom = 0.0f;
     mouseRot = make_identity<float, 4>();
@@ -303,7 +438,13 @@ int main(int argc, char* argv[])
         std::cout << "usage: " << argv[0] << " <xRes> <yRes> < <iv-file>\n";
         exit(1);
     }
-    parse_file(std::cin, &scene);
+    read_scene(std::cin, 0, &scene);
+    for (unsigned i = 0; i < scene.separators.size(); i++)
+    {
+        compute_bounds(scene.separators[i]);
+        build_mesh(scene.separators[i]);
+        build_lods(scene.separators[i]);
+    }
     
     // OpenGL will take out any arguments intended for its use here.
     // Useful ones are -display and -gldebug.
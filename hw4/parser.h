@@ -35,6 +35,19 @@ struct Transform
     Vector3 scaling;
 };
 
+// A separator's faces as triangles over one list of vertices, filled in by
+// build_mesh.  Vertex i is points[i] with normal normals[i].
+struct Mesh
+{
+    std::vector<Vector3> points;
+    std::vector<Vector3> normals;
+    // Three vertices per triangle, wound the same way as the faces
+    std::vector<int> triangles;
+    // How far, in object space, the surface may be from the separator's
+    // faces.  0 for the full mesh, see simplify.cpp for the others.
+    float error;
+};
+
 struct Separator
 {
     std::vector<Transform> transforms;
@@ -46,6 +59,14 @@ struct Separator
     std::vector<int> normalindices;
 
     Material material;
+    Mesh mesh;
+    // Simpler versions of mesh, each with about half the triangles of the
+    // one before, filled in by build_lods
+    std::vector<Mesh> lods;
+    // Object space bounds of the points, filled in by compute_bounds
+    Vector3 boxMin, boxMax;
+    Vector3 sphereCenter;
+    float sphereRadius;
 };
 
 struct Scene
@@ -0,0 +1,94 @@
+#include <iostream>
+#include <cstdlib>
+#include "parser.h"
+#include "scenefile.h"
+
+void parse_file(std::istream &input, Scene *output);
+
+/**
+ * Reads a scene from input, which can be either an Open Inventor text file or
+ * a binary scene file (scenefile.h).  fd is input's file descriptor, or -1;
+ * binary files on a regular file descriptor are mapped instead of read.
+ */
+void read_scene(std::istream &input, int fd, Scene *output)
+{
+    if (!isSceneFile(input))
+    {
+        parse_file(input, output);
+        return;
+    }
+
+    sceneFile file;
+    if (!file.load(input, fd))
+    {
+        std::cerr << "Not a scene file this can read\n";
+        exit(1);
+    }
+    const sceneFileHeader &h = file.header();
+
+    // Only the last camera counts, as when parsing
+    const sceneFileCamera *cameras = file.array<sceneFileCamera>(h.camerasOffset, h.numCameras);
+    if (h.numCameras > 0)
+    {
+        const sceneFileCamera &c = cameras[h.numCameras - 1];
+        Camera &cam = output->camera;
+        cam.position = makeVector3(c.position[0], c.position[1], c.position[2]);
+        cam.orientation = makeVector4(c.orientation[0], c.orientation[1], c.orientation[2], c.orientation[3]);
+        cam.nearDistance = c.nearDistance;
+        cam.farDistance = c.farDistance;
+        cam.left = c.left;
+        cam.right = c.right;
+        cam.top = c.top;
+        cam.bottom = c.bottom;
+    }
+
+    const sceneFileLight *lights = file.array<sceneFileLight>(h.lightsOffset, h.numLights);
+    output->lights.resize(h.numLights);
+    for (unsigned i = 0; i < h.numLights; i++)
+    {
+        output->lights[i].position = makeVector3(lights[i].position[0], lights[i].position[1], lights[i].position[2]);
+        output->lights[i].color = makeVector3(lights[i].color[0], lights[i].color[1], lights[i].color[2]);
+    }
+
+    const sceneFileSeparator *seps = file.array<sceneFileSeparator>(h.separatorsOffset, h.numSeparators);
+    output->separators.resize(h.numSeparators);
+    for (unsigned s = 0; s < h.numSeparators; s++)
+    {
+        const sceneFileSeparator &in = seps[s];
+        Separator &sep = output->separators[s];
+
+        const sceneFileTransform *transforms = file.array<sceneFileTransform>(in.transformsOffset, in.numTransforms);
+        const float *points = file.array<float>(in.pointsOffset, in.numPoints * 3ull);
+        const int32_t *indices = file.array<int32_t>(in.indicesOffset, in.numIndices);
+        const float *normals = file.array<float>(in.normalsOffset, in.numNormals * 3ull);
+        const int32_t *normalindices = file.array<int32_t>(in.normalIndicesOffset, in.numNormalIndices);
+        if (!transforms || !points || !indices || !normals || !normalindices)
+        {
+            std::cerr << "Scene file is truncated\n";
+            exit(1);
+        }
+
+        sep.material.ambientColor = makeVector3(in.ambientColor[0], in.ambientColor[1], in.ambientColor[2]);
+        sep.material.diffuseColor = makeVector3(in.diffuseColor[0], in.diffuseColor[1], in.diffuseColor[2]);
+        sep.material.specularColor = makeVector3(in.specularColor[0], in.specularColor[1], in.specularColor[2]);
+        sep.material.shininess = in.shininess;
+
+        sep.transforms.resize(in.numTransforms);
+        for (unsigned i = 0; i < in.numTransforms; i++)
+        {
+            const sceneFileTransform &t = transforms[i];
+            sep.transforms[i].translation = makeVector3(t.translation[0], t.translation[1], t.translation[2]);
+            sep.transforms[i].rotation = makeVector4(t.rotation[0], t.rotation[1], t.rotation[2], t.rotation[3]);
+            sep.transforms[i].scaling = makeVector3(t.scaling[0], t.scaling[1], t.scaling[2]);
+        }
+
+        sep.points.resize(in.numPoints);
+        for (unsigned i = 0; i < in.numPoints; i++)
+            sep.points[i] = makeVector3(points[3*i], points[3*i+1], points[3*i+2]);
+        sep.normals.resize(in.numNormals);
+        for (unsigned i = 0; i < in.numNormals; i++)
+            sep.normals[i] = makeVector3(normals[3*i], normals[3*i+1], normals[3*i+2]);
+        sep.indices.assign(indices, indices + in.numIndices);
+        sep.normalindices.assign(normalindices, normalindices + in.numNormalIndices);
+    }
+}
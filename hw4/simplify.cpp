@@ -0,0 +1,531 @@
+#include <vector>
+#include <map>
+#include <queue>
+#include <algorithm>
+#include <cmath>
+#include "parser.h"
+
+void optimize_mesh(Mesh &mesh);
+
+// LOD chains stop before a level would have fewer triangles than this, or
+// after this many levels
+static const int LOD_MIN_TRIANGLES = 64;
+static const unsigned LOD_MAX_LEVELS = 8;
+
+// Edges on the boundary of an open surface get a plane through them,
+// perpendicular to their triangle, weighted this much more than the planes
+// of triangles so the boundary stays put
+static const double BOUNDARY_WEIGHT = 10;
+
+// When a position collapses onto another, each of its vertices becomes the
+// vertex there with the nearest normal, if their normals are at least this
+// close (the cosine of the angle between them).  Creases sharper than that
+// keep their own vertices.
+static const float NORMAL_MERGE_COS = 0.5f;
+
+static void cross(const double a[3], const double b[3], double out[3])
+{
+    out[0] = a[1] * b[2] - a[2] * b[1];
+    out[1] = a[2] * b[0] - a[0] * b[2];
+    out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+static double dot(const double a[3], const double b[3])
+{
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+// The unnormalized normal of the triangle p0 p1 p2
+static void triangle_normal(const double *p0, const double *p1, const double *p2, double out[3])
+{
+    double e1[3], e2[3];
+    for (int c = 0; c < 3; c++)
+    {
+        e1[c] = p1[c] - p0[c];
+        e2[c] = p2[c] - p0[c];
+    }
+    cross(e1, e2, out);
+}
+
+/**
+ * The sum of squared distances to a set of planes, as the symmetric 4x4
+ * matrix of Garland and Heckbert, "Surface Simplification Using Quadric
+ * Error Metrics".  Only the upper triangle is kept.
+ */
+struct quadric
+{
+    double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+
+    quadric() : a2(0), ab(0), ac(0), ad(0), b2(0), bc(0), bd(0), c2(0), cd(0), d2(0) {}
+
+    // The plane ax + by + cz + d = 0, (a, b, c) unit length, counted weight
+    // times
+    quadric(double a, double b, double c, double d, double weight) :
+        a2(weight * a * a), ab(weight * a * b), ac(weight * a * c), ad(weight * a * d),
+        b2(weight * b * b), bc(weight * b * c), bd(weight * b * d),
+        c2(weight * c * c), cd(weight * c * d), d2(weight * d * d)
+    {
+    }
+
+    quadric &operator+=(const quadric &q)
+    {
+        a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+        b2 += q.b2; bc += q.bc; bd += q.bd;
+        c2 += q.c2; cd += q.cd; d2 += q.d2;
+        return *this;
+    }
+
+    // The sum of squared distances from p to the planes
+    double error(const double p[3]) const
+    {
+        double x = p[0], y = p[1], z = p[2];
+        return a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x
+            + b2 * y * y + 2 * bc * y * z + 2 * bd * y
+            + c2 * z * z + 2 * cd * z + d2;
+    }
+
+    // Finds the point with the least error.  Returns false if there isn't
+    // a single one, as when all the planes are parallel.
+    bool minimum(double p[3]) const
+    {
+        double det = a2 * (b2 * c2 - bc * bc) - ab * (ab * c2 - bc * ac) + ac * (ab * bc - b2 * ac);
+        double scale = (a2 + b2 + c2) / 3;
+        if (fabs(det) <= 1e-6 * scale * scale * scale)
+            return false;
+
+        // Cramer's rule on the gradient being 0
+        double rx = -ad, ry = -bd, rz = -cd;
+        p[0] = (rx * (b2 * c2 - bc * bc) - ab * (ry * c2 - bc * rz) + ac * (ry * bc - b2 * rz)) / det;
+        p[1] = (a2 * (ry * c2 - bc * rz) - rx * (ab * c2 - bc * ac) + ac * (ab * rz - ry * ac)) / det;
+        p[2] = (a2 * (b2 * rz - ry * bc) - ab * (ab * rz - ry * ac) + rx * (ab * bc - b2 * ac)) / det;
+        return true;
+    }
+};
+
+// Orders Vector3s by their coordinates, to weld equal positions
+struct pointLess
+{
+    bool operator()(const Vector3 &a, const Vector3 &b) const
+    {
+        for (int c = 0; c < 3; c++)
+            if (a(c) != b(c))
+                return a(c) < b(c);
+        return false;
+    }
+};
+
+/**
+ * Simplifies a mesh by collapsing edges, cheapest by quadric error first.
+ * Collapses work on positions rather than mesh vertices, so vertices that
+ * share a position but not a normal move together and no cracks open; each
+ * vertex keeps its normal.  Collapses that would flip a triangle over are
+ * skipped.  The original mesh must outlive this.
+ */
+class meshSimplifier
+{
+public:
+    meshSimplifier(const Mesh &mesh) : mesh_(mesh), liveTriangles_(mesh.triangles.size() / 3), error_(0)
+    {
+        // Weld vertices by position
+        std::map<Vector3, int, pointLess> welded;
+        position_.resize(mesh.points.size());
+        for (unsigned v = 0; v < mesh.points.size(); v++)
+        {
+            std::pair<std::map<Vector3, int, pointLess>::iterator, bool> found =
+                welded.insert(std::make_pair(mesh.points[v], static_cast<int>(points_.size() / 3)));
+            if (found.second)
+                for (int c = 0; c < 3; c++)
+                    points_.push_back(mesh.points[v](c));
+            position_[v] = found.first->second;
+        }
+        int numPositions = points_.size() / 3;
+        quadrics_.resize(numPositions);
+        version_.assign(numPositions, 0);
+        around_.resize(numPositions);
+        vertices_.resize(numPositions);
+        mergedInto_.resize(mesh.points.size());
+        for (unsigned v = 0; v < mesh.points.size(); v++)
+        {
+            vertices_[position_[v]].push_back(v);
+            mergedInto_[v] = v;
+        }
+
+        int numTriangles = liveTriangles_;
+        corners_.resize(mesh.triangles.size());
+        dead_.assign(numTriangles, false);
+        // Triangles on each edge, by the positions at its ends
+        std::map<std::pair<int, int>, int> edgeCount;
+        for (int t = 0; t < numTriangles; t++)
+        {
+            for (int c = 0; c < 3; c++)
+                corners_[3*t + c] = position_[mesh.triangles[3*t + c]];
+            const int *p = &corners_[3*t];
+            if (p[0] == p[1] || p[1] == p[2] || p[2] == p[0])
+            {
+                dead_[t] = true;
+                liveTriangles_--;
+                continue;
+            }
+            for (int c = 0; c < 3; c++)
+            {
+                around_[p[c]].push_back(t);
+                edgeCount[std::make_pair(std::min(p[c], p[(c + 1) % 3]), std::max(p[c], p[(c + 1) % 3]))]++;
+            }
+
+            double n[3];
+            if (!unit_normal(t, n))
+                continue;
+            quadric plane(n[0], n[1], n[2], -dot(n, point(p[0])), 1);
+            for (int c = 0; c < 3; c++)
+                quadrics_[p[c]] += plane;
+        }
+
+        // Hold boundary edges in place
+        for (int t = 0; t < numTriangles; t++)
+        {
+            double n[3];
+            if (dead_[t] || !unit_normal(t, n))
+                continue;
+            const int *p = &corners_[3*t];
+            for (int c = 0; c < 3; c++)
+            {
+                int a = p[c], b = p[(c + 1) % 3];
+                if (edgeCount[std::make_pair(std::min(a, b), std::max(a, b))] != 1)
+                    continue;
+                double edge[3], side[3];
+                for (int i = 0; i < 3; i++)
+                    edge[i] = point(b)[i] - point(a)[i];
+                cross(edge, n, side);
+                double length = sqrt(dot(side, side));
+                if (length == 0)
+                    continue;
+                for (int i = 0; i < 3; i++)
+                    side[i] /= length;
+                quadric plane(side[0], side[1], side[2], -dot(side, point(a)), BOUNDARY_WEIGHT);
+                quadrics_[a] += plane;
+                quadrics_[b] += plane;
+            }
+        }
+
+        for (std::map<std::pair<int, int>, int>::const_iterator it = edgeCount.begin(); it != edgeCount.end(); it++)
+            push(it->first.first, it->first.second);
+    }
+
+    // Collapses edges until at most target triangles are left or no more
+    // can be.  Returns how many are left.
+    int collapseTo(int target)
+    {
+        while (liveTriangles_ > target && !heap_.empty())
+        {
+            collapse next = heap_.top();
+            heap_.pop();
+            // Either end has changed since this was worked out
+            if (version_[next.from] != next.fromVersion || version_[next.to] != next.toVersion)
+                continue;
+            if (flips(next.from, next.to, next.target) || flips(next.to, next.from, next.target))
+                continue;
+            apply(next);
+        }
+        return liveTriangles_;
+    }
+
+    int triangles() const
+    {
+        return liveTriangles_;
+    }
+
+    // The surface as it is now, ordered by optimize_mesh.  Its error is the
+    // largest any collapse so far has caused.
+    Mesh snapshot() const
+    {
+        Mesh out;
+        out.points.resize(mesh_.points.size());
+        for (unsigned v = 0; v < mesh_.points.size(); v++)
+        {
+            const double *p = point(position_[v]);
+            out.points[v] = makeVector3(p[0], p[1], p[2]);
+        }
+        out.normals = mesh_.normals;
+        for (unsigned t = 0; t < dead_.size(); t++)
+            if (!dead_[t])
+                for (int c = 0; c < 3; c++)
+                    out.triangles.push_back(current(mesh_.triangles[3*t + c]));
+        out.error = error_;
+        optimize_mesh(out);
+        return out;
+    }
+
+private:
+    // Moving position from onto to, both ending up at target
+    struct collapse
+    {
+        double cost;
+        int from, to;
+        unsigned fromVersion, toVersion;
+        double target[3];
+
+        // Cheapest on top of the heap
+        bool operator<(const collapse &c) const
+        {
+            return cost > c.cost;
+        }
+    };
+
+    const Mesh &mesh_;
+    // The position of each mesh vertex, and 3 coordinates per position
+    std::vector<int> position_;
+    // The vertices still in use at each position
+    std::vector<std::vector<int> > vertices_;
+    std::vector<double> points_;
+    std::vector<quadric> quadrics_;
+    // Bumped whenever a position moves or goes away, to spot stale collapses
+    std::vector<unsigned> version_;
+    // The vertex each mesh vertex was merged into, or itself
+    std::vector<int> mergedInto_;
+    // Triangles using each position, including some that have since died
+    std::vector<std::vector<int> > around_;
+    // The position at each corner of each triangle
+    std::vector<int> corners_;
+    std::vector<bool> dead_;
+    std::priority_queue<collapse> heap_;
+    int liveTriangles_;
+    double error_;
+
+    double *point(int p)
+    {
+        return &points_[3*p];
+    }
+
+    const double *point(int p) const
+    {
+        return &points_[3*p];
+    }
+
+    // The vertex mesh vertex v ended up as
+    int current(int v) const
+    {
+        while (mergedInto_[v] != v)
+            v = mergedInto_[v];
+        return v;
+    }
+
+    bool unit_normal(int t, double n[3]) const
+    {
+        const int *p = &corners_[3*t];
+        triangle_normal(point(p[0]), point(p[1]), point(p[2]), n);
+        double length = sqrt(dot(n, n));
+        if (length == 0)
+            return false;
+        for (int c = 0; c < 3; c++)
+            n[c] /= length;
+        return true;
+    }
+
+    // Works out the collapse of the edge a b and queues it
+    void push(int a, int b)
+    {
+        quadric q = quadrics_[a];
+        q += quadrics_[b];
+
+        collapse c;
+        if (!q.minimum(c.target))
+        {
+            // No single best point, so take the best of the ends and middle
+            double candidates[3][3];
+            for (int i = 0; i < 3; i++)
+            {
+                candidates[0][i] = point(a)[i];
+                candidates[1][i] = point(b)[i];
+                candidates[2][i] = (point(a)[i] + point(b)[i]) / 2;
+            }
+            int best = 0;
+            for (int k = 1; k < 3; k++)
+                if (q.error(candidates[k]) < q.error(candidates[best]))
+                    best = k;
+            std::copy(candidates[best], candidates[best] + 3, c.target);
+        }
+        c.cost = std::max(0.0, q.error(c.target));
+        c.from = a;
+        c.to = b;
+        c.fromVersion = version_[a];
+        c.toVersion = version_[b];
+        heap_.push(c);
+    }
+
+    // Returns true if moving p to target would turn over one of its
+    // triangles that survives the collapse of p onto other
+    bool flips(int p, int other, const double target[3]) const
+    {
+        for (unsigned i = 0; i < around_[p].size(); i++)
+        {
+            int t = around_[p][i];
+            if (dead_[t])
+                continue;
+            const int *corner = &corners_[3*t];
+            if (corner[0] == other || corner[1] == other || corner[2] == other)
+                continue;
+
+            const double *before[3], *after[3];
+            for (int c = 0; c < 3; c++)
+            {
+                before[c] = point(corner[c]);
+                after[c] = corner[c] == p ? target : before[c];
+            }
+            double n0[3], n1[3];
+            triangle_normal(before[0], before[1], before[2], n0);
+            triangle_normal(after[0], after[1], after[2], n1);
+            if (dot(n0, n1) <= 0)
+                return true;
+        }
+        return false;
+    }
+
+    void apply(const collapse &c)
+    {
+        int from = c.from, to = c.to;
+        error_ = std::max(error_, sqrt(c.cost));
+        std::copy(c.target, c.target + 3, point(to));
+        quadrics_[to] += quadrics_[from];
+        version_[from]++;
+        version_[to]++;
+
+        // from's vertices merge into to's where their normals agree and
+        // move there otherwise
+        const std::vector<Vector3> &normals = mesh_.normals;
+        std::vector<int> &vertices = vertices_[to];
+        unsigned numVertices = vertices.size();
+        for (unsigned i = 0; i < vertices_[from].size(); i++)
+        {
+            int v = vertices_[from][i];
+            int nearest = -1;
+            float nearestCos = NORMAL_MERGE_COS;
+            for (unsigned j = 0; j < numVertices; j++)
+            {
+                const Vector3 &a = normals[v], &b = normals[vertices[j]];
+                float cos = a.dot(b) / sqrtf(a.dot(a) * b.dot(b));
+                if (cos >= nearestCos)
+                {
+                    nearest = vertices[j];
+                    nearestCos = cos;
+                }
+            }
+            if (nearest >= 0)
+                mergedInto_[v] = nearest;
+            else
+            {
+                position_[v] = to;
+                vertices.push_back(v);
+            }
+        }
+        std::vector<int>().swap(vertices_[from]);
+
+        // Triangles with both ends of the edge are gone, the rest of from's
+        // move to to
+        for (unsigned i = 0; i < around_[from].size(); i++)
+        {
+            int t = around_[from][i];
+            if (dead_[t])
+                continue;
+            int *corner = &corners_[3*t];
+            if (corner[0] == to || corner[1] == to || corner[2] == to)
+            {
+                dead_[t] = true;
+                liveTriangles_--;
+                continue;
+            }
+            for (int k = 0; k < 3; k++)
+                if (corner[k] == from)
+                    corner[k] = to;
+            around_[to].push_back(t);
+        }
+        std::vector<int>().swap(around_[from]);
+
+        // Drop dead triangles from to's list, and requeue its edges
+        std::vector<int> &triangles = around_[to];
+        triangles.erase(std::remove_if(triangles.begin(), triangles.end(), isDead(dead_)), triangles.end());
+        std::vector<int> neighbours;
+        for (unsigned i = 0; i < triangles.size(); i++)
+            for (int k = 0; k < 3; k++)
+            {
+                int n = corners_[3*triangles[i] + k];
+                if (n != to && std::find(neighbours.begin(), neighbours.end(), n) == neighbours.end())
+                    neighbours.push_back(n);
+            }
+        for (unsigned i = 0; i < neighbours.size(); i++)
+            push(neighbours[i], to);
+    }
+
+    struct isDead
+    {
+        isDead(const std::vector<bool> &dead) : dead_(dead) {}
+        bool operator()(int t) const
+        {
+            return dead_[t];
+        }
+        const std::vector<bool> &dead_;
+    };
+};
+
+/**
+ * Returns mesh simplified to at most targetTriangles triangles, or as close
+ * as it can get without turning triangles over.
+ */
+Mesh simplify_mesh(const Mesh &mesh, int targetTriangles)
+{
+    meshSimplifier simplifier(mesh);
+    simplifier.collapseTo(targetTriangles);
+    return simplifier.snapshot();
+}
+
+/**
+ * Fills in sep.lods from sep.mesh, each level with half the triangles of the
+ * one before, until levels would get too small or simplifying stalls.
+ */
+void build_lods(Separator &sep)
+{
+    sep.lods.clear();
+    meshSimplifier simplifier(sep.mesh);
+    while (sep.lods.size() < LOD_MAX_LEVELS)
+    {
+        int before = simplifier.triangles();
+        if (before / 2 < LOD_MIN_TRIANGLES)
+            break;
+        // Not worth a level if it couldn't even lose a quarter
+        if (simplifier.collapseTo(before / 2) > before * 3 / 4)
+            break;
+        sep.lods.push_back(simplifier.snapshot());
+    }
+}
+
+/**
+ * Picks the simplest of sep's meshes whose error, seen through objectToClip
+ * on an xRes by yRes image, is at most maxPixels pixels.  The error is
+ * projected at the point of the bounding sphere nearest the eye, so it's
+ * never underestimated.  maxPixels of 0 always picks the full mesh.
+ */
+const Mesh &select_lod(const Separator &sep, const Matrix4 &objectToClip, int xRes, int yRes,
+        float maxPixels)
+{
+    if (maxPixels <= 0 || sep.lods.empty())
+        return sep.mesh;
+
+    // Clip space w, which x and y get divided by, is smallest at the point
+    // of the sphere nearest the eye.  Inside the sphere anything goes.
+    const Matrix4 &m = objectToClip;
+    const Vector3 &center = sep.sphereCenter;
+    float w = m(3, 0) * center(0) + m(3, 1) * center(1) + m(3, 2) * center(2) + m(3, 3);
+    float nearest = w - sep.sphereRadius * sqrtf(m(3, 0) * m(3, 0) + m(3, 1) * m(3, 1) + m(3, 2) * m(3, 2));
+    if (nearest <= 0)
+        return sep.mesh;
+
+    // The most an object space length can stretch to in clip space x and y,
+    // which span 2w across the image
+    float xScale = sqrtf(m(0, 0) * m(0, 0) + m(0, 1) * m(0, 1) + m(0, 2) * m(0, 2)) * xRes / 2;
+    float yScale = sqrtf(m(1, 0) * m(1, 0) + m(1, 1) * m(1, 1) + m(1, 2) * m(1, 2)) * yRes / 2;
+    float pixelsPerUnit = std::max(xScale, yScale) / nearest;
+
+    const Mesh *lod = &sep.mesh;
+    for (unsigned i = 0; i < sep.lods.size() && sep.lods[i].error * pixelsPerUnit <= maxPixels; i++)
+        lod = &sep.lods[i];
+    return *lod;
+}